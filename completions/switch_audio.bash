@@ -0,0 +1,55 @@
+# bash completion for switch_audio
+#
+# Device names come from `switch_audio --complete`, which answers from the
+# on-disk device cache without touching CoreAudio.
+
+_switch_audio() {
+    local cur=${COMP_WORDS[COMP_CWORD]} prev=${COMP_WORDS[COMP_CWORD-1]}
+    local role=output i
+    for ((i = 1; i < COMP_CWORD - 1; i++)); do
+        case ${COMP_WORDS[i]} in
+            -t|--type) role=${COMP_WORDS[i+1]} ;;
+        esac
+    done
+
+    case $prev in
+        -t|--type)
+            COMPREPLY=($(compgen -W "output input system" -- "$cur"))
+            return ;;
+        --format)
+            COMPREPLY=($(compgen -W "text json tsv nul" -- "$cur"))
+            return ;;
+        --batch)
+            COMPREPLY=($(compgen -f -- "$cur"))
+            return ;;
+        --volume|--rate|--buffer|--timeout|--retry|--backoff|--bench|--set|--name|--scene|--save-scene|\
+        --only|--prefer|--hotkey|--uid|--teardown|--aggregate)
+            return ;;
+    esac
+
+    if [[ $cur == -* ]]; then
+        COMPREPLY=($(compgen -W "-l --list --format --latency -n --next --only --hide-virtual
+            --set -t --type --uid --all --volume --mute --unmute --rate --buffer --aggregate
+            --name --teardown --scene --save-scene -w --wait --timeout --retry --backoff --batch --bench --watch
+            --daemon --stats --prefer --hotkey --trace --complete --version -h --help" -- "$cur"))
+        return
+    fi
+
+    # Inside an open quote readline closes it itself; otherwise escape spaces.
+    local quoted= word=$cur name
+    if [[ $word == [\"\']* ]]; then
+        quoted=1
+        word=${word:1}
+    fi
+    local IFS=$'\n'
+    COMPREPLY=()
+    for name in $(command switch_audio --complete -t "$role" -- "$word" 2>/dev/null); do
+        if [[ -n $quoted ]]; then
+            COMPREPLY+=("$name")
+        else
+            COMPREPLY+=("$(printf '%q' "$name")")
+        fi
+    done
+}
+
+complete -F _switch_audio switch_audio
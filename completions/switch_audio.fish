@@ -0,0 +1,53 @@
+# fish completion for switch_audio
+#
+# Device names come from `switch_audio --complete`, which answers from the
+# on-disk device cache without touching CoreAudio.
+
+function __switch_audio_devices
+    set -l tokens (commandline -opc)
+    set -l role output
+    for i in (seq 2 (math (count $tokens) - 1))
+        if contains -- $tokens[$i] -t --type
+            set role $tokens[(math $i + 1)]
+        end
+    end
+    set -l word (commandline -ct | string replace -r '^["\']' '')
+    switch_audio --complete -t $role -- "$word" 2>/dev/null
+end
+
+complete -c switch_audio -f -a '(__switch_audio_devices)'
+complete -c switch_audio -s l -l list -d 'List devices'
+complete -c switch_audio -l format -x -a 'text json tsv nul' -d 'List format'
+complete -c switch_audio -l latency -d 'Show effective latency per device'
+complete -c switch_audio -s n -l next -d 'Switch to the next device'
+complete -c switch_audio -l only -x -d 'Consider only these transports'
+complete -c switch_audio -l hide-virtual -d 'Ignore virtual and aggregate devices'
+complete -c switch_audio -l set -x -d 'Cycle -n through a rotation set'
+complete -c switch_audio -s t -l type -x -a 'output input system' -d 'Device role for following actions'
+complete -c switch_audio -l uid -x -d 'Switch by UID or alias'
+complete -c switch_audio -l all -x -a '(__switch_audio_devices)' -d 'Default output, input and system device'
+complete -c switch_audio -l volume -x -d 'Set or step the volume'
+complete -c switch_audio -l mute -d 'Mute the device'
+complete -c switch_audio -l unmute -d 'Unmute the device'
+complete -c switch_audio -l rate -x -d 'Set the sample rate'
+complete -c switch_audio -l buffer -x -d 'Set the I/O buffer size'
+complete -c switch_audio -l aggregate -x -d 'Create a multi-output device'
+complete -c switch_audio -l name -x -d 'Name for --aggregate'
+complete -c switch_audio -l teardown -x -d 'Remove an aggregate device'
+complete -c switch_audio -l scene -x -d 'Apply a saved scene'
+complete -c switch_audio -l save-scene -x -d 'Save the current defaults as a scene'
+complete -c switch_audio -s w -l wait -d 'Block until the switch has landed'
+complete -c switch_audio -l timeout -x -d 'Give up waiting after MS'
+complete -c switch_audio -l retry -x -d 'Retry a failed switch N times'
+complete -c switch_audio -l backoff -x -d 'First wait between retries'
+complete -c switch_audio -l batch -r -F -d 'Run command lines from a file'
+complete -c switch_audio -l bench -x -d 'Benchmark every command path'
+complete -c switch_audio -l watch -d 'Print default-device and hotplug events'
+complete -c switch_audio -l daemon -d 'Serve requests from a cached device table'
+complete -c switch_audio -l stats -d "Print the daemon's metrics in Prometheus format"
+complete -c switch_audio -l prefer -x -d 'Auto-switch preference list'
+complete -c switch_audio -l hotkey -x -d 'Bind a global shortcut in the daemon'
+complete -c switch_audio -l trace -d 'Log every HAL call'
+complete -c switch_audio -l complete -d 'Print completion candidates'
+complete -c switch_audio -l version -d 'Print the version'
+complete -c switch_audio -s h -l help -d 'Show help'
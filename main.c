@@ -1,314 +1,6247 @@
 // main.c
-// Compile with: clang main.c -framework CoreAudio -framework CoreFoundation -o switch_audio
+// Compile with: clang main.c -framework CoreAudio -framework AudioToolbox -framework Carbon
+//     -framework CoreFoundation -o switch_audio
+// (or add -DSWITCH_AUDIO_NO_AUDIOTOOLBOX -DSWITCH_AUDIO_NO_HOTKEYS and drop AudioToolbox and
+// Carbon, as `make fast` does)
 
 #include <CoreAudio/CoreAudio.h>
+#ifndef SWITCH_AUDIO_NO_AUDIOTOOLBOX
 #include <AudioToolbox/AudioToolbox.h>
+#endif
+#ifndef SWITCH_AUDIO_NO_HOTKEYS
+#include <Carbon/Carbon.h>
+#endif
 #include <CoreFoundation/CoreFoundation.h>
 #include <string.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdatomic.h>
+#include <dispatch/dispatch.h>
+#include <mach/mach_time.h>
+#include <os/signpost.h>
+#include <errno.h>
+#include <pthread.h>
+#include <time.h>
+#include <signal.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <spawn.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/sysctl.h>
+#include <sys/time.h>
+#include <sys/un.h>
+#include <sys/wait.h>
 
-static OSStatus getAudioDeviceList(AudioDeviceID **devices, UInt32 *deviceCount) {
+#ifndef SWITCH_AUDIO_VERSION
+#define SWITCH_AUDIO_VERSION "dev"
+#endif
+
+extern char **environ;
+
+// ---------------------------------------------------------------------------
+// Tracing
+//
+// With --trace or SWITCH_AUDIO_TRACE=1, every HAL property call goes to stderr
+// with its object, selector and duration, so a stalled device is visible by
+// name. Allocations and CFString conversions are counted, a summary is
+// printed at exit, and phases are bracketed with os_signpost intervals for
+// Instruments. When tracing is off each wrapper costs one branch.
+// ---------------------------------------------------------------------------
+
+static bool traceEnabled;
+static os_log_t traceLog;
+
+static struct {
+    atomic_ulong propertyGets;
+    atomic_ulong propertySizes;
+    atomic_ulong propertySets;
+    atomic_ulong mallocs;
+    atomic_ulong stringConversions;
+    atomic_ullong halTicks;
+} traceCounters;
+
+#define TRACE_BEGIN(spid, name, ...) \
+    do { if (traceLog) { os_signpost_interval_begin(traceLog, spid, name, ##__VA_ARGS__); } } while (0)
+#define TRACE_END(spid, name, ...) \
+    do { if (traceLog) { os_signpost_interval_end(traceLog, spid, name, ##__VA_ARGS__); } } while (0)
+
+static os_signpost_id_t traceSignpostID(void) {
+    return traceLog ? os_signpost_id_generate(traceLog) : OS_SIGNPOST_ID_NULL;
+}
+
+static const mach_timebase_info_data_t* getTimebase(void) {
+    static mach_timebase_info_data_t timebase;
+    if (timebase.denom == 0) {
+        mach_timebase_info(&timebase);
+    }
+    return &timebase;
+}
+
+static double ticksToMicros(UInt64 ticks) {
+    const mach_timebase_info_data_t *timebase = getTimebase();
+    return (double)ticks * timebase->numer / timebase->denom / 1000.0;
+}
+
+static UInt64 millisToTicks(long ms) {
+    const mach_timebase_info_data_t *timebase = getTimebase();
+    return (UInt64)((double)ms * 1e6 * timebase->denom / timebase->numer);
+}
+
+static void formatFourCC(UInt32 code, char out[5]) {
+    for (int i = 0; i < 4; i++) {
+        char c = (char)(code >> (24 - 8 * i));
+        out[i] = (c >= 0x20 && c < 0x7f) ? c : '?';
+    }
+    out[4] = '\0';
+}
+
+static void traceHALCall(const char *op, AudioObjectID objectID, const AudioObjectPropertyAddress *addr,
+                         UInt64 start, OSStatus status) {
+    UInt64 elapsed = mach_absolute_time() - start;
+    atomic_fetch_add_explicit(&traceCounters.halTicks, elapsed, memory_order_relaxed);
+
+    char selector[5], scope[5];
+    formatFourCC(addr->mSelector, selector);
+    formatFourCC(addr->mScope, scope);
+    if (status == noErr) {
+        fprintf(stderr, "[trace] %-4s %6u %s/%s %10.1f us\n", op, (unsigned)objectID,
+                selector, scope, ticksToMicros(elapsed));
+    } else {
+        fprintf(stderr, "[trace] %-4s %6u %s/%s %10.1f us  error %d\n", op, (unsigned)objectID,
+                selector, scope, ticksToMicros(elapsed), (int)status);
+    }
+}
+
+static OSStatus halGetPropertyDataSize(AudioObjectID objectID, const AudioObjectPropertyAddress *addr,
+                                       UInt32 qualifierSize, const void *qualifier, UInt32 *size) {
+    if (!traceEnabled) {
+        return AudioObjectGetPropertyDataSize(objectID, addr, qualifierSize, qualifier, size);
+    }
+    atomic_fetch_add_explicit(&traceCounters.propertySizes, 1, memory_order_relaxed);
+    UInt64 start = mach_absolute_time();
+    OSStatus status = AudioObjectGetPropertyDataSize(objectID, addr, qualifierSize, qualifier, size);
+    traceHALCall("size", objectID, addr, start, status);
+    return status;
+}
+
+static OSStatus halGetPropertyData(AudioObjectID objectID, const AudioObjectPropertyAddress *addr,
+                                   UInt32 qualifierSize, const void *qualifier, UInt32 *size, void *data) {
+    if (!traceEnabled) {
+        return AudioObjectGetPropertyData(objectID, addr, qualifierSize, qualifier, size, data);
+    }
+    atomic_fetch_add_explicit(&traceCounters.propertyGets, 1, memory_order_relaxed);
+    UInt64 start = mach_absolute_time();
+    OSStatus status = AudioObjectGetPropertyData(objectID, addr, qualifierSize, qualifier, size, data);
+    traceHALCall("get", objectID, addr, start, status);
+    return status;
+}
+
+static OSStatus halSetPropertyData(AudioObjectID objectID, const AudioObjectPropertyAddress *addr,
+                                   UInt32 qualifierSize, const void *qualifier, UInt32 size, const void *data) {
+    if (!traceEnabled) {
+        return AudioObjectSetPropertyData(objectID, addr, qualifierSize, qualifier, size, data);
+    }
+    atomic_fetch_add_explicit(&traceCounters.propertySets, 1, memory_order_relaxed);
+    UInt64 start = mach_absolute_time();
+    OSStatus status = AudioObjectSetPropertyData(objectID, addr, qualifierSize, qualifier, size, data);
+    traceHALCall("set", objectID, addr, start, status);
+    return status;
+}
+
+#ifndef SWITCH_AUDIO_NO_AUDIOTOOLBOX
+// AudioToolbox's hardware service layer owns the virtual main volume, which
+// the HAL itself does not publish; these are traced like the calls above.
+// Builds without it fall back to the HAL's own volume controls.
+static OSStatus halServiceGetPropertyData(AudioObjectID objectID, const AudioObjectPropertyAddress *addr,
+                                          UInt32 *size, void *data) {
+    if (!traceEnabled) {
+        return AudioHardwareServiceGetPropertyData(objectID, addr, 0, NULL, size, data);
+    }
+    atomic_fetch_add_explicit(&traceCounters.propertyGets, 1, memory_order_relaxed);
+    UInt64 start = mach_absolute_time();
+    OSStatus status = AudioHardwareServiceGetPropertyData(objectID, addr, 0, NULL, size, data);
+    traceHALCall("sget", objectID, addr, start, status);
+    return status;
+}
+
+static OSStatus halServiceSetPropertyData(AudioObjectID objectID, const AudioObjectPropertyAddress *addr,
+                                          UInt32 size, const void *data) {
+    if (!traceEnabled) {
+        return AudioHardwareServiceSetPropertyData(objectID, addr, 0, NULL, size, data);
+    }
+    atomic_fetch_add_explicit(&traceCounters.propertySets, 1, memory_order_relaxed);
+    UInt64 start = mach_absolute_time();
+    OSStatus status = AudioHardwareServiceSetPropertyData(objectID, addr, 0, NULL, size, data);
+    traceHALCall("sset", objectID, addr, start, status);
+    return status;
+}
+#endif
+
+static void* tracedMalloc(size_t size) {
+    if (traceEnabled) {
+        atomic_fetch_add_explicit(&traceCounters.mallocs, 1, memory_order_relaxed);
+    }
+    return malloc(size);
+}
+
+static void* tracedCalloc(size_t count, size_t size) {
+    if (traceEnabled) {
+        atomic_fetch_add_explicit(&traceCounters.mallocs, 1, memory_order_relaxed);
+    }
+    return calloc(count, size);
+}
+
+
+static void countStringConversion(void) {
+    if (traceEnabled) {
+        atomic_fetch_add_explicit(&traceCounters.stringConversions, 1, memory_order_relaxed);
+    }
+}
+
+static void printTraceSummary(void) {
+    fprintf(stderr, "[trace] %lu get, %lu size, %lu set HAL calls (%.1f us total); "
+                    "%lu allocations; %lu CFString conversions\n",
+            atomic_load(&traceCounters.propertyGets), atomic_load(&traceCounters.propertySizes),
+            atomic_load(&traceCounters.propertySets), ticksToMicros(atomic_load(&traceCounters.halTicks)),
+            atomic_load(&traceCounters.mallocs), atomic_load(&traceCounters.stringConversions));
+}
+
+static void enableTrace(void) {
+    if (traceEnabled) {
+        return;
+    }
+    traceEnabled = true;
+    traceLog = os_log_create("com.github.tungmv.switch_audio", "latency");
+    atexit(printTraceSummary);
+}
+
+// ---------------------------------------------------------------------------
+// Arena allocation
+//
+// Everything a snapshot owns (the device table, its hash indices and every
+// UID, name and match key) is bump-allocated from one arena and released in
+// one go. The first block is sized for a well-equipped machine, so building
+// a snapshot normally costs one malloc; only unusually large device counts
+// chain further blocks.
+// ---------------------------------------------------------------------------
+
+#define ARENA_BLOCK_SIZE 16384
+#define ARENA_ALIGN 16
+
+typedef struct ArenaBlock {
+    struct ArenaBlock *next;
+    size_t size;
+    size_t used;
+    unsigned char *data;
+} ArenaBlock;
+
+typedef struct {
+    ArenaBlock *blocks;
+} Arena;
+
+static void* arenaAlloc(Arena *arena, size_t size) {
+    size = (size + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+    ArenaBlock *block = arena->blocks;
+    if (!block || block->size - block->used < size) {
+        size_t blockSize = size > ARENA_BLOCK_SIZE ? size : ARENA_BLOCK_SIZE;
+        size_t header = (sizeof(ArenaBlock) + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+        block = tracedMalloc(header + blockSize);
+        if (!block) {
+            return NULL;
+        }
+        block->data = (unsigned char *)block + header;
+        block->size = blockSize;
+        block->used = 0;
+        block->next = arena->blocks;
+        arena->blocks = block;
+    }
+    void *ptr = block->data + block->used;
+    block->used += size;
+    return ptr;
+}
+
+static void* arenaCalloc(Arena *arena, size_t count, size_t size) {
+    void *ptr = arenaAlloc(arena, count * size);
+    if (ptr) {
+        memset(ptr, 0, count * size);
+    }
+    return ptr;
+}
+
+static char* arenaStrdup(Arena *arena, const char *str) {
+    if (!str) {
+        return NULL;
+    }
+    size_t len = strlen(str) + 1;
+    char *copy = arenaAlloc(arena, len);
+    if (copy) {
+        memcpy(copy, str, len);
+    }
+    return copy;
+}
+
+static void freeArena(Arena *arena) {
+    while (arena->blocks) {
+        ArenaBlock *next = arena->blocks->next;
+        free(arena->blocks);
+        arena->blocks = next;
+    }
+}
+
+// Device IDs from one kAudioHardwarePropertyDevices read. Up to
+// DEVICE_LIST_INLINE of them live in the struct itself, on the caller's stack.
+#define DEVICE_LIST_INLINE 64
+
+typedef struct {
+    AudioDeviceID *ids;
+    UInt32 count;
+    AudioDeviceID inlineIDs[DEVICE_LIST_INLINE];
+} DeviceList;
+
+static void freeDeviceList(DeviceList *list) {
+    if (list->ids != list->inlineIDs) {
+        free(list->ids);
+    }
+    list->ids = NULL;
+}
+
+static OSStatus getAudioDeviceList(DeviceList *list) {
     AudioObjectPropertyAddress propertyAddress = {
         .mSelector = kAudioHardwarePropertyDevices,
         .mScope = kAudioObjectPropertyScopeGlobal,
         .mElement = kAudioObjectPropertyElementMain
     };
 
+    os_signpost_id_t signpost = traceSignpostID();
+    TRACE_BEGIN(signpost, "enumerate");
+
     UInt32 size = 0;
-    OSStatus err = AudioObjectGetPropertyDataSize(kAudioObjectSystemObject, &propertyAddress, 0, NULL, &size);
+    OSStatus err = halGetPropertyDataSize(kAudioObjectSystemObject, &propertyAddress, 0, NULL, &size);
     if (err != noErr) {
+        TRACE_END(signpost, "enumerate");
         return err;
     }
 
-    *deviceCount = size / sizeof(AudioDeviceID);
-    *devices = malloc(size);
-    if (!*devices) {
+    list->ids = size <= sizeof(list->inlineIDs) ? list->inlineIDs : tracedMalloc(size);
+    if (!list->ids) {
+        TRACE_END(signpost, "enumerate");
         return kAudioHardwareBadDeviceError;
     }
 
-    err = AudioObjectGetPropertyData(kAudioObjectSystemObject, &propertyAddress, 0, NULL, &size, *devices);
+    err = halGetPropertyData(kAudioObjectSystemObject, &propertyAddress, 0, NULL, &size, list->ids);
+    list->count = size / sizeof(AudioDeviceID);
     if (err != noErr) {
-        free(*devices);
-        *devices = NULL;
+        freeDeviceList(list);
     }
+    TRACE_END(signpost, "enumerate", "%u devices", (unsigned)list->count);
     return err;
 }
 
+// The system-wide defaults a command can change. The system output carries
+// alerts and UI sounds and, like the main output, needs an output stream.
+typedef enum {
+    ROLE_OUTPUT,
+    ROLE_INPUT,
+    ROLE_SYSTEM,
+    ROLE_COUNT
+} DeviceRole;
+
+static const AudioObjectPropertySelector roleSelectors[ROLE_COUNT] = {
+    kAudioHardwarePropertyDefaultOutputDevice,
+    kAudioHardwarePropertyDefaultInputDevice,
+    kAudioHardwarePropertyDefaultSystemOutputDevice
+};
+
+static const char *const roleNames[ROLE_COUNT] = { "output", "input", "system output" };
+
+static bool parseDeviceRole(const char *arg, DeviceRole *role) {
+    if (strcmp(arg, "output") == 0) {
+        *role = ROLE_OUTPUT;
+    } else if (strcmp(arg, "input") == 0) {
+        *role = ROLE_INPUT;
+    } else if (strcmp(arg, "system") == 0) {
+        *role = ROLE_SYSTEM;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+// The system (alert) device plays through its output streams like any other.
+static AudioObjectPropertyScope roleScope(DeviceRole role) {
+    return role == ROLE_INPUT ? kAudioDevicePropertyScopeInput : kAudioDevicePropertyScopeOutput;
+}
+
 // Function declarations
-static OSStatus setDefaultOutputDevice(AudioDeviceID deviceID);
+static OSStatus setDefaultDevice(DeviceRole role, AudioDeviceID deviceID);
 
-static AudioDeviceID getCurrentDefaultOutputDevice() {
+static AudioDeviceID getCurrentDefaultDevice(DeviceRole role) {
     AudioDeviceID deviceID;
     UInt32 size = sizeof(deviceID);
     AudioObjectPropertyAddress addr = {
-        .mSelector = kAudioHardwarePropertyDefaultOutputDevice,
+        .mSelector = roleSelectors[role],
         .mScope = kAudioObjectPropertyScopeGlobal,
         .mElement = kAudioObjectPropertyElementMain
     };
 
-    return (AudioObjectGetPropertyData(kAudioObjectSystemObject, &addr, 0, NULL, &size, &deviceID) == noErr) 
+    return (halGetPropertyData(kAudioObjectSystemObject, &addr, 0, NULL, &size, &deviceID) == noErr) 
            ? deviceID : kAudioObjectUnknown;
 }
 
-static char* getDeviceName(AudioDeviceID deviceID) {
-    CFStringRef deviceName = NULL;
-    UInt32 size = sizeof(deviceName);
+static bool getUInt32Property(AudioObjectID objectID, AudioObjectPropertySelector selector,
+                              AudioObjectPropertyScope scope, UInt32 *value) {
+    UInt32 size = sizeof(*value);
     AudioObjectPropertyAddress addr = {
-        .mSelector = kAudioObjectPropertyName,
-        .mScope = kAudioObjectPropertyScopeGlobal,
+        .mSelector = selector,
+        .mScope = scope,
         .mElement = kAudioObjectPropertyElementMain
     };
+    return halGetPropertyData(objectID, &addr, 0, NULL, &size, value) == noErr;
+}
+
+static bool writeAll(int fd, const void *buf, size_t len) {
+    const char *p = buf;
+    while (len > 0) {
+        ssize_t n = write(fd, p, len);
+        if (n < 0) {
+            if (errno == EINTR) {
+                continue;
+            }
+            return false;
+        }
+        p += n;
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+// Copies a CFString out as UTF-8, into buf when it fits and otherwise into a
+// malloc'd copy. CFStrings that already hold their bytes in a compatible form
+// hand them out through CFStringGetCStringPtr, which costs a memcpy rather
+// than a transcode; only the rest are converted, into an exactly sized
+// buffer instead of CFStringGetMaximumSizeForEncoding's 4x worst case.
+static char* copyUTF8String(CFStringRef str, char *buf, size_t bufSize) {
+    const char *direct = CFStringGetCStringPtr(str, kCFStringEncodingUTF8);
+    if (direct) {
+        size_t len = strlen(direct);
+        char *copy = buf && len < bufSize ? buf : tracedMalloc(len + 1);
+        if (copy) {
+            memcpy(copy, direct, len + 1);
+        }
+        return copy;
+    }
 
-    if (AudioObjectGetPropertyData(deviceID, &addr, 0, NULL, &size, &deviceName) != noErr || !deviceName) {
+    countStringConversion();
+    if (buf && CFStringGetCString(str, buf, (CFIndex)bufSize, kCFStringEncodingUTF8)) {
+        return buf;
+    }
+
+    CFRange range = CFRangeMake(0, CFStringGetLength(str));
+    CFIndex byteCount = 0;
+    if (CFStringGetBytes(str, range, kCFStringEncodingUTF8, 0, false, NULL, 0, &byteCount) != range.length) {
         return NULL;
     }
+    char *copy = tracedMalloc((size_t)byteCount + 1);
+    if (copy) {
+        CFStringGetBytes(str, range, kCFStringEncodingUTF8, 0, false, (UInt8 *)copy, byteCount, NULL);
+        copy[byteCount] = '\0';
+    }
+    return copy;
+}
 
-    // Get the actual required buffer size
-    CFIndex nameLength = CFStringGetLength(deviceName);
-    CFIndex maxSize = CFStringGetMaximumSizeForEncoding(nameLength, kCFStringEncodingUTF8) + 1;
+// Fetches a CFString-valued device property as UTF-8, into buf when it fits
+// and otherwise into a malloc'd copy. Pass a NULL buf to always get a copy.
+static char* getDeviceStringProperty(AudioDeviceID deviceID, AudioObjectPropertySelector selector,
+                                     char *buf, size_t bufSize) {
+    CFStringRef value = NULL;
+    UInt32 size = sizeof(value);
+    AudioObjectPropertyAddress addr = {
+        .mSelector = selector,
+        .mScope = kAudioObjectPropertyScopeGlobal,
+        .mElement = kAudioObjectPropertyElementMain
+    };
 
-    char* nameBuf = malloc(maxSize);
-    if (nameBuf && CFStringGetCString(deviceName, nameBuf, maxSize, kCFStringEncodingUTF8)) {
-        CFRelease(deviceName);
-        return nameBuf;
+    if (halGetPropertyData(deviceID, &addr, 0, NULL, &size, &value) != noErr || !value) {
+        return NULL;
     }
 
-    CFRelease(deviceName);
-    free(nameBuf);
-    return NULL;
+    char *str = copyUTF8String(value, buf, bufSize);
+    CFRelease(value);
+    return str;
+}
+
+static char* getDeviceName(AudioDeviceID deviceID) {
+    return getDeviceStringProperty(deviceID, kAudioObjectPropertyName, NULL, 0);
+}
+
+static char* getDeviceUID(AudioDeviceID deviceID) {
+    return getDeviceStringProperty(deviceID, kAudioDevicePropertyDeviceUID, NULL, 0);
+}
+
+// One HAL call instead of an enumeration; kAudioObjectUnknown when no
+// device currently has that UID.
+static AudioDeviceID translateUIDToDevice(const char *uid) {
+    CFStringRef uidString = CFStringCreateWithCString(kCFAllocatorDefault, uid, kCFStringEncodingUTF8);
+    if (!uidString) {
+        return kAudioObjectUnknown;
+    }
+    AudioObjectPropertyAddress addr = {
+        .mSelector = kAudioHardwarePropertyTranslateUIDToDevice,
+        .mScope = kAudioObjectPropertyScopeGlobal,
+        .mElement = kAudioObjectPropertyElementMain
+    };
+    AudioDeviceID deviceID = kAudioObjectUnknown;
+    UInt32 size = sizeof(deviceID);
+    if (halGetPropertyData(kAudioObjectSystemObject, &addr, sizeof(uidString), &uidString, &size, &deviceID) != noErr) {
+        deviceID = kAudioObjectUnknown;
+    }
+    CFRelease(uidString);
+    return deviceID;
 }
 
-static bool deviceSupportsOutput(AudioDeviceID deviceID) {
+// Reads the stream layout for one scope (output or input) and reports both
+// whether the device has streams there and how many channels they carry.
+static bool deviceSupportsScope(AudioDeviceID deviceID, AudioObjectPropertyScope scope,
+                                UInt32 *channelCount) {
     AudioObjectPropertyAddress addr = {
         .mSelector = kAudioDevicePropertyStreamConfiguration,
-        .mScope = kAudioDevicePropertyScopeOutput,
+        .mScope = scope,
         .mElement = kAudioObjectPropertyElementMain
     };
 
+    *channelCount = 0;
+
     UInt32 size = 0;
-    OSStatus err = AudioObjectGetPropertyDataSize(deviceID, &addr, 0, NULL, &size);
+    OSStatus err = halGetPropertyDataSize(deviceID, &addr, 0, NULL, &size);
     if (err != noErr) {
         return false;
     }
 
-    AudioBufferList* bufferList = (AudioBufferList*)malloc(size);
+    // Room for eight streams on the stack; larger layouts spill to the heap.
+    union {
+        AudioBufferList list;
+        UInt8 bytes[sizeof(AudioBufferList) + 7 * sizeof(AudioBuffer)];
+    } stackList;
+    AudioBufferList* bufferList = size <= sizeof(stackList) ? &stackList.list : tracedMalloc(size);
     if (!bufferList) {
         return false;
     }
 
-    err = AudioObjectGetPropertyData(deviceID, &addr, 0, NULL, &size, bufferList);
+    err = halGetPropertyData(deviceID, &addr, 0, NULL, &size, bufferList);
     if (err != noErr) {
-        free(bufferList);
+        if (bufferList != &stackList.list) {
+            free(bufferList);
+        }
         return false;
     }
 
-    bool hasOutput = bufferList->mNumberBuffers > 0;
+    bool hasStreams = bufferList->mNumberBuffers > 0;
     for (UInt32 i = 0; i < bufferList->mNumberBuffers; i++) {
         if (bufferList->mBuffers[i].mNumberChannels == 0) {
-            hasOutput = false;
+            hasStreams = false;
             break;
         }
+        *channelCount += bufferList->mBuffers[i].mNumberChannels;
+    }
+    if (!hasStreams) {
+        *channelCount = 0;
     }
 
-    free(bufferList);
-    return hasOutput;
+    if (bufferList != &stackList.list) {
+        free(bufferList);
+    }
+    return hasStreams;
 }
 
-static void listAudioDevices() {
-    AudioDeviceID *devices;
-    UInt32 deviceCount;
-
-    if (getAudioDeviceList(&devices, &deviceCount) != noErr) {
-        fprintf(stderr, "Error getting device list\n");
-        return;
+static Float64 getNominalSampleRate(AudioDeviceID deviceID) {
+    AudioObjectPropertyAddress propertyAddress = {
+        kAudioDevicePropertyNominalSampleRate,
+        kAudioObjectPropertyScopeGlobal,
+        kAudioObjectPropertyElementMain
+    };
+    Float64 rate = 0;
+    UInt32 dataSize = sizeof(rate);
+    if (halGetPropertyData(deviceID, &propertyAddress, 0, NULL, &dataSize, &rate) != noErr) {
+        return 0;
     }
+    return rate;
+}
 
-    AudioDeviceID currentDefault = getCurrentDefaultOutputDevice();
+// One entry per HAL device, classified for both scopes in the same probe.
+// Names and UIDs are only fetched for devices with streams in either scope,
+// since those are the only ones any command ever shows or matches.
+typedef struct {
+    AudioDeviceID id;
+    bool hasOutput;
+    bool hasInput;
+    bool unresponsive;  // probe timed out; nothing else is known
+    UInt32 outputChannels;
+    UInt32 inputChannels;
+    UInt32 transportType;
+    Float64 sampleRate;  // 0 when not known yet; see ensureSampleRates()
+    AudioValueRange *availableRates;    // NULL until ensureDeviceFormats()
+    UInt32 availableRateCount;
+    AudioValueRange bufferRange;
+    bool latencyKnown;  // see ensureLatencies()
+    AudioObjectPropertyScope latencyScope;
+    UInt32 hardwareLatency;     // frames, in latencyScope
+    UInt32 safetyOffset;
+    UInt32 bufferFrames;
+    UInt32 streamLatency;
+    bool hidden;        // filtered out by --only/--hide-virtual for this command
+    char* uid;
+    char* name;
+    char* matchName;    // lowercased, whitespace-collapsed copy of name
+    UInt32 nameHash;    // hash of matchName
+    UInt32 uidHash;
+} DeviceInfo;
 
-    printf("Available Audio Output Devices:\n");
-    printf("================================\n");
+// Input devices serve the input role; main and system output both need output.
+// A device hidden by a transport filter serves no role at all.
+static bool deviceHasRole(const DeviceInfo *info, DeviceRole role) {
+    return !info->hidden && (role == ROLE_INPUT ? info->hasInput : info->hasOutput);
+}
 
-    for (UInt32 i = 0; i < deviceCount; ++i) {
-        AudioDeviceID dev = devices[i];
+static UInt32 deviceChannels(const DeviceInfo *info, DeviceRole role) {
+    return role == ROLE_INPUT ? info->inputChannels : info->outputChannels;
+}
 
-        // Only show devices that support output
-        if (!deviceSupportsOutput(dev)) {
-            continue;
-        }
+typedef struct {
+    UInt32 type;
+    const char *name;
+} TransportName;
 
-        char* deviceName = getDeviceName(dev);
-        if (deviceName) {
-            if (dev == currentDefault) {
-                printf("* %s\n", deviceName);
-            } else {
-                printf("  %s\n", deviceName);
-            }
-            free(deviceName);
+static const TransportName transportNames[] = {
+    { kAudioDeviceTransportTypeBuiltIn, "builtin" },
+    { kAudioDeviceTransportTypeAggregate, "aggregate" },
+    { kAudioDeviceTransportTypeAutoAggregate, "aggregate" },
+    { kAudioDeviceTransportTypeVirtual, "virtual" },
+    { kAudioDeviceTransportTypePCI, "pci" },
+    { kAudioDeviceTransportTypeUSB, "usb" },
+    { kAudioDeviceTransportTypeFireWire, "firewire" },
+    { kAudioDeviceTransportTypeBluetooth, "bluetooth" },
+    { kAudioDeviceTransportTypeBluetoothLE, "bluetooth-le" },
+    { kAudioDeviceTransportTypeHDMI, "hdmi" },
+    { kAudioDeviceTransportTypeDisplayPort, "displayport" },
+    { kAudioDeviceTransportTypeAirPlay, "airplay" },
+    { kAudioDeviceTransportTypeAVB, "avb" },
+    { kAudioDeviceTransportTypeThunderbolt, "thunderbolt" }
+};
+
+#define TRANSPORT_NAME_COUNT (sizeof(transportNames) / sizeof(transportNames[0]))
+
+static const char* transportTypeName(UInt32 transportType) {
+    for (size_t i = 0; i < TRANSPORT_NAME_COUNT; i++) {
+        if (transportNames[i].type == transportType) {
+            return transportNames[i].name;
         }
     }
-
-    free(devices);
+    return "unknown";
 }
 
-static void switchToNextDevice() {
-    AudioDeviceID *devices;
-    UInt32 deviceCount;
+// --only and --hide-virtual. Everything but the transport type can be skipped
+// for a device the filter rejects, so it is applied inside the probe.
+typedef struct {
+    UInt32 allowed[TRANSPORT_NAME_COUNT];
+    UInt32 allowedCount;    // 0 allows every transport
+    bool hideVirtual;       // virtual and aggregate devices
+} TransportFilter;
 
-    if (getAudioDeviceList(&devices, &deviceCount) != noErr) {
-        fprintf(stderr, "Error getting device list\n");
-        return;
-    }
+static bool transportFilterActive(const TransportFilter *filter) {
+    return filter && (filter->allowedCount > 0 || filter->hideVirtual);
+}
 
-    AudioDeviceID currentDefault = getCurrentDefaultOutputDevice();
-    AudioDeviceID outputDevices[deviceCount]; // VLA for small arrays
-    int outputCount = 0;
-    int currentIndex = -1;
+static bool transportAllowed(const TransportFilter *filter, UInt32 transportType) {
+    if (!transportFilterActive(filter)) {
+        return true;
+    }
+    if (filter->hideVirtual && (transportType == kAudioDeviceTransportTypeVirtual
+                                || transportType == kAudioDeviceTransportTypeAggregate
+                                || transportType == kAudioDeviceTransportTypeAutoAggregate)) {
+        return false;
+    }
+    if (filter->allowedCount == 0) {
+        return true;
+    }
+    for (UInt32 i = 0; i < filter->allowedCount; i++) {
+        if (filter->allowed[i] == transportType) {
+            return true;
+        }
+    }
+    return false;
+}
 
-    // Single pass: build output array and find current device
-    for (UInt32 i = 0; i < deviceCount; i++) {
-        if (deviceSupportsOutput(devices[i])) {
-            if (devices[i] == currentDefault) {
-                currentIndex = outputCount;
+// Parses "builtin,usb,bluetooth"; "bluetooth" also admits Bluetooth LE.
+static bool parseTransportList(const char *list, TransportFilter *filter) {
+    filter->allowedCount = 0;
+    for (const char *item = list; item; ) {
+        const char *itemEnd = strchr(item, ',');
+        const char *next = itemEnd ? itemEnd + 1 : NULL;
+        size_t len = itemEnd ? (size_t)(itemEnd - item) : strlen(item);
+        bool known = false;
+        for (size_t i = 0; i < TRANSPORT_NAME_COUNT; i++) {
+            const char *name = transportNames[i].name;
+            bool matches = strncmp(name, item, len) == 0
+                && (name[len] == '\0' || (len == 9 && strcmp(name, "bluetooth-le") == 0));
+            if (matches && filter->allowedCount < TRANSPORT_NAME_COUNT) {
+                filter->allowed[filter->allowedCount++] = transportNames[i].type;
+                known = true;
             }
-            outputDevices[outputCount++] = devices[i];
         }
+        if (!known) {
+            return false;
+        }
+        item = next;
     }
+    return true;
+}
 
-    free(devices);
+// Open-addressed hash table over snapshot indices. Slots hold index + 1 so
+// that zero can mark an empty slot.
+typedef struct {
+    UInt32 *slots;
+    UInt32 mask;
+} DeviceIndex;
 
-    if (outputCount <= 1) {
-        printf("Only one or no output devices available. Cannot switch.\n");
-        return;
-    }
+// Size and mtime of a config file; zero for one that does not exist.
+typedef struct {
+    SInt64 mtime;
+    SInt64 size;
+} ConfigStamp;
 
-    int nextIndex = (currentIndex + 1) % outputCount;
-    AudioDeviceID nextDevice = outputDevices[nextIndex];
+// A rotation set resolved against one snapshot: the connected members that
+// can take the role, in the user's order, so repeated -n --set presses are an
+// index increment instead of a walk over every device. One read back from the
+// disk cache is checked against the files' stamps instead, which costs two
+// stat() calls rather than parsing both files.
+typedef struct {
+    char *setKey;               // normalized set name; NULL until resolved
+    DeviceRole role;
+    UInt32 setGeneration;       // config generations it was resolved from
+    UInt32 aliasGeneration;
+    ConfigStamp setStamp;       // and the files as they were then
+    ConfigStamp aliasStamp;
+    bool stored;                // loaded from the disk cache
+    UInt32 *members;            // indices into the snapshot's devices
+    UInt32 count;
+    UInt32 position;            // member switched to last
+} RotationCycle;
 
-    char* currentName = getDeviceName(currentDefault);
-    char* nextName = getDeviceName(nextDevice);
+// Everything a command needs from the HAL, gathered in a single pass so no
+// property is fetched twice per invocation.
+typedef struct {
+    DeviceInfo *devices;
+    UInt32 count;
+    AudioDeviceID defaults[ROLE_COUNT];
+    UInt32 unresponsiveCount;
+    DeviceIndex byName;
+    DeviceIndex byUID;
+    RotationCycle cycle;
+    bool partial;       // probe skipped filtered devices; never cached
+    bool filtered;      // hidden flags currently set
+    bool cycleChanged;  // cycle resolved here, not yet in the disk cache
+    Arena arena;        // owns devices, index slots and every string above
+} DeviceSnapshot;
 
-    if (setDefaultOutputDevice(nextDevice) == noErr) {
-        printf("Switched from \"%s\" to \"%s\"\n",
-               currentName ?: "Unknown", nextName ?: "Unknown");
-    } else {
-        fprintf(stderr, "Failed to set default output device\n");
+// FNV-1a; device names are short, so this is cheaper than anything fancier.
+static UInt32 hashString(const char *s) {
+    UInt32 hash = 2166136261u;
+    for (; *s; s++) {
+        hash ^= (unsigned char)*s;
+        hash *= 16777619u;
     }
+    return hash;
+}
 
-    free(currentName);
-    free(nextName);
+// Lowercases ASCII letters and collapses whitespace runs into single spaces,
+// so "External  headphones" and "external headphones" compare equal. norm
+// needs room for strlen(name) + 1 bytes.
+static void normalizeNameInto(const char *name, char *norm) {
+    char *dst = norm;
+    bool pendingSpace = false;
+    for (const unsigned char *src = (const unsigned char *)name; *src; src++) {
+        if (*src == ' ' || *src == '\t') {
+            pendingSpace = dst != norm;
+            continue;
+        }
+        if (pendingSpace) {
+            *dst++ = ' ';
+            pendingSpace = false;
+        }
+        *dst++ = (*src >= 'A' && *src <= 'Z') ? (char)(*src + ('a' - 'A')) : (char)*src;
+    }
+    *dst = '\0';
 }
 
-static OSStatus setDefaultOutputDevice(AudioDeviceID deviceID) {
-    AudioObjectPropertyAddress addr = {
-        .mSelector = kAudioHardwarePropertyDefaultOutputDevice,
-        .mScope = kAudioObjectPropertyScopeGlobal,
-        .mElement = kAudioObjectPropertyElementMain
-    };
-    UInt32 size = sizeof(deviceID);
-    return AudioObjectSetPropertyData(kAudioObjectSystemObject,
-                                      &addr,
-                                      0,
-                                      NULL,
-                                      size,
-                                      &deviceID);
+// Normalizes into buf when the name fits, else into a malloc'd copy; callers
+// free the result only when it is not buf.
+static char* normalizeName(const char *name, char *buf, size_t bufSize) {
+    size_t len = strlen(name);
+    char *norm = len < bufSize ? buf : tracedMalloc(len + 1);
+    if (norm) {
+        normalizeNameInto(name, norm);
+    }
+    return norm;
 }
 
-static AudioDeviceID findDeviceByName(const char* wantedName) {
-    AudioDeviceID *devices;
-    UInt32 deviceCount;
+static bool initDeviceIndex(Arena *arena, DeviceIndex *index, UInt32 entries) {
+    UInt32 capacity = 8;
+    while (capacity < entries * 2) {
+        capacity <<= 1;
+    }
+    index->slots = arenaCalloc(arena, capacity, sizeof(UInt32));
+    index->mask = capacity - 1;
+    return index->slots != NULL;
+}
 
-    if (getAudioDeviceList(&devices, &deviceCount) != noErr) {
-        return kAudioObjectUnknown;
+static void indexInsert(DeviceIndex *index, UInt32 hash, UInt32 deviceIndex) {
+    UInt32 slot = hash & index->mask;
+    while (index->slots[slot]) {
+        slot = (slot + 1) & index->mask;
     }
+    index->slots[slot] = deviceIndex + 1;
+}
 
-    size_t wantedLen = strlen(wantedName);
+static bool buildDeviceIndices(DeviceSnapshot *snap) {
+    if (!initDeviceIndex(&snap->arena, &snap->byName, snap->count)
+        || !initDeviceIndex(&snap->arena, &snap->byUID, snap->count)) {
+        return false;
+    }
 
-    AudioDeviceID found = kAudioObjectUnknown;
+    for (UInt32 i = 0; i < snap->count; i++) {
+        DeviceInfo *info = &snap->devices[i];
+        if (info->matchName) {
+            indexInsert(&snap->byName, info->nameHash, i);
+        }
+        if (info->uid) {
+            indexInsert(&snap->byUID, info->uidHash, i);
+        }
+    }
+    return true;
+}
 
-    for (UInt32 i = 0; i < deviceCount && found == kAudioObjectUnknown; ++i) {
-        AudioDeviceID dev = devices[i];
+static void freeDeviceSnapshot(DeviceSnapshot *snap) {
+    freeArena(&snap->arena);
+    snap->devices = NULL;
+    snap->byName.slots = NULL;
+    snap->byUID.slots = NULL;
+    snap->cycle = (RotationCycle){ 0 };
+    snap->count = 0;
+}
 
-        // Only consider devices that support output
-        if (!deviceSupportsOutput(dev)) {
-            continue;
-        }
+// Hides the devices a command's transport filter rejects, or with no active
+// filter shows everything again. Long-lived snapshots get this per command,
+// and a rotation order resolved under a different filter is dropped.
+static void applyTransportFilter(DeviceSnapshot *snap, const TransportFilter *filter) {
+    bool active = transportFilterActive(filter);
+    if (!active && !snap->filtered) {
+        return;
+    }
+    for (UInt32 i = 0; i < snap->count; i++) {
+        snap->devices[i].hidden = !transportAllowed(filter, snap->devices[i].transportType);
+    }
+    snap->cycle = (RotationCycle){ 0 };
+    snap->filtered = active;
+}
 
-        char* deviceName = getDeviceName(dev);
-        if (deviceName) {
-            // Compare with wanted name using length check first
-            if (strlen(deviceName) == wantedLen && memcmp(deviceName, wantedName, wantedLen) == 0) {
-                found = dev;
-            }
-            free(deviceName);
+// Derives the match keys and hash indices once the raw fields are filled in,
+// wherever they came from.
+static OSStatus finishDeviceSnapshot(DeviceSnapshot *snap) {
+    for (UInt32 i = 0; i < snap->count; i++) {
+        DeviceInfo *info = &snap->devices[i];
+        if (info->uid) {
+            info->uidHash = hashString(info->uid);
         }
+        if (info->name && (info->matchName = arenaAlloc(&snap->arena, strlen(info->name) + 1))) {
+            normalizeNameInto(info->name, info->matchName);
+            info->nameHash = hashString(info->matchName);
+        }
+    }
+
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        snap->defaults[role] = getCurrentDefaultDevice((DeviceRole)role);
     }
 
-    free(devices);
-    return found;
+    if (!buildDeviceIndices(snap)) {
+        freeDeviceSnapshot(snap);
+        return kAudioHardwareBadDeviceError;
+    }
+    return noErr;
 }
 
+// ---------------------------------------------------------------------------
+// Metrics
+//
+// The daemon counts what it does, so a fleet can be scraped for the dock or
+// headset that makes switching slow without attaching Instruments: fixed-
+// bucket latency histograms per operation and per device, failed sets, and
+// connects/disconnects per UID. `switch_audio --stats` returns them in the
+// Prometheus text format. Counters are relaxed atomics like the trace
+// counters; the device table only grows, and only on the daemon's run loop
+// thread. Once it is full, new devices are logged once and only counted.
+// Outside the daemon metrics are off and each hook costs one branch.
+// ---------------------------------------------------------------------------
+
+#define METRICS_MAX_DEVICES 64
+
+typedef enum {
+    METRIC_ENUMERATE,
+    METRIC_RESOLVE,
+    METRIC_SET_DEFAULT,
+    METRIC_CONFIRM,
+    METRIC_OP_COUNT
+} MetricOp;
+
+static const char *const metricOpNames[METRIC_OP_COUNT] = {
+    [METRIC_ENUMERATE] = "enumerate",
+    [METRIC_RESOLVE] = "resolve",
+    [METRIC_SET_DEFAULT] = "set_default",
+    [METRIC_CONFIRM] = "confirm",
+};
+
+// Bucket upper bounds in microseconds; one more bucket catches the rest.
+static const UInt32 metricBucketMicros[] = {
+    50, 100, 250, 500, 1000, 2500, 5000, 10000, 25000, 50000, 100000, 250000, 500000, 1000000, 2500000
+};
+#define METRIC_BUCKET_COUNT (sizeof(metricBucketMicros) / sizeof(metricBucketMicros[0]) + 1)
+
+typedef struct {
+    atomic_ullong buckets[METRIC_BUCKET_COUNT];     // per bucket; made cumulative on export
+    atomic_ullong count;
+    atomic_ullong sumMicros;
+} Histogram;
 
+typedef enum {
+    DEVICE_SET_FAILURES,
+    DEVICE_CONNECTS,
+    DEVICE_DISCONNECTS,
+    DEVICE_COUNTER_COUNT
+} DeviceCounter;
 
-static void printUsage(const char* progName) {
-    printf("Usage: %s [OPTIONS] [DEVICE_NAME]\n\n", progName);
-    printf("Switch macOS default audio output device\n\n");
-    printf("Options:\n");
-    printf("  -l, --list    List available audio output devices\n");
-    printf("  -n, --next    Switch to next available device\n");
-    printf("  -h, --help    Show this help message\n\n");
-    printf("Examples:\n");
-    printf("  %s -l                          # List available devices\n", progName);
-    printf("  %s \"External Headphones\"      # Switch to headphones\n", progName);
+static const struct {
+    const char *metric;
+    const char *help;
+} deviceCounterInfo[DEVICE_COUNTER_COUNT] = {
+    [DEVICE_SET_FAILURES] = { "switch_audio_device_set_failures_total",
+                              "Failed attempts to make the device a default." },
+    [DEVICE_CONNECTS] = { "switch_audio_device_connects_total",
+                          "Times the device appeared after the daemon started." },
+    [DEVICE_DISCONNECTS] = { "switch_audio_device_disconnects_total", "Times the device disappeared." },
+};
+
+typedef struct {
+    char *uid;
+    char *name;
+    AudioDeviceID id;           // kAudioObjectUnknown while disconnected
+    Histogram ops[METRIC_OP_COUNT];
+    atomic_ulong counters[DEVICE_COUNTER_COUNT];
+} DeviceMetrics;
+
+typedef enum {
+    REQUEST_SOCKET,
+    REQUEST_HOTKEY,
+    REQUEST_SOURCE_COUNT
+} RequestSource;
+
+static const char *const requestSourceNames[REQUEST_SOURCE_COUNT] = { "socket", "hotkey" };
+
+static bool metricsEnabled;
+static time_t metricsStartTime;
+
+static struct {
+    Histogram ops[METRIC_OP_COUNT];
+    atomic_ulong setFailures;
+    atomic_ulong requests[REQUEST_SOURCE_COUNT];
+    atomic_ulong requestFailures[REQUEST_SOURCE_COUNT];
+    atomic_ulong rebuilds;
+    DeviceMetrics devices[METRICS_MAX_DEVICES];
+    atomic_uint deviceCount;
+    atomic_uint droppedDevices;     // in the current snapshot but not in the table
+    bool overflowLogged;
+} metrics;
+
+static void enableMetrics(void) {
+    metricsEnabled = true;
+    metricsStartTime = time(NULL);
 }
 
-int main(int argc, char* argv[]) {
-    if (argc < 2) {
-        printUsage(argv[0]);
-        return 1;
+static void recordHistogram(Histogram *histogram, UInt64 micros) {
+    size_t bucket = 0;
+    while (bucket < METRIC_BUCKET_COUNT - 1 && micros > metricBucketMicros[bucket]) {
+        bucket++;
     }
+    atomic_fetch_add_explicit(&histogram->buckets[bucket], 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->count, 1, memory_order_relaxed);
+    atomic_fetch_add_explicit(&histogram->sumMicros, micros, memory_order_relaxed);
+}
 
-    // Handle list option
-    if (strcmp(argv[1], "-l") == 0 || strcmp(argv[1], "--list") == 0) {
-        listAudioDevices();
-        return 0;
+static DeviceMetrics* findDeviceMetrics(AudioDeviceID deviceID) {
+    unsigned count = atomic_load_explicit(&metrics.deviceCount, memory_order_acquire);
+    for (unsigned i = 0; deviceID != kAudioObjectUnknown && i < count; i++) {
+        if (metrics.devices[i].id == deviceID) {
+            return &metrics.devices[i];
+        }
     }
+    return NULL;
+}
 
-    // Handle next device option
-    if (strcmp(argv[1], "-n") == 0 || strcmp(argv[1], "--next") == 0) {
-        switchToNextDevice();
-        return 0;
+// Records an operation that began at startTicks, also under the device it
+// concerned when that is known.
+static void recordOperation(MetricOp op, AudioDeviceID deviceID, UInt64 startTicks) {
+    if (!metricsEnabled) {
+        return;
     }
+    UInt64 micros = (UInt64)ticksToMicros(mach_absolute_time() - startTicks);
+    recordHistogram(&metrics.ops[op], micros);
+    DeviceMetrics *device = findDeviceMetrics(deviceID);
+    if (device) {
+        recordHistogram(&device->ops[op], micros);
+    }
+}
 
-    // Handle help option
-    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
-        printUsage(argv[0]);
-        return 0;
+static void recordSetFailure(AudioDeviceID deviceID) {
+    if (!metricsEnabled) {
+        return;
     }
+    atomic_fetch_add_explicit(&metrics.setFailures, 1, memory_order_relaxed);
+    DeviceMetrics *device = findDeviceMetrics(deviceID);
+    if (device) {
+        atomic_fetch_add_explicit(&device->counters[DEVICE_SET_FAILURES], 1, memory_order_relaxed);
+    }
+}
 
-    // Handle device switching
-    if (argc != 2) {
-        fprintf(stderr, "Error: Please provide exactly one device name.\n\n");
-        printUsage(argv[0]);
-        return 1;
+static void recordRequest(RequestSource source, int status) {
+    atomic_fetch_add_explicit(&metrics.requests[source], 1, memory_order_relaxed);
+    if (status != 0) {
+        atomic_fetch_add_explicit(&metrics.requestFailures[source], 1, memory_order_relaxed);
     }
+}
 
-    const char* deviceName = argv[1];
+// Matches the device table against a new snapshot by UID. A device that is
+// gone counts a disconnect; one that is back, new, or reappeared under a
+// different ID (unplugged and replugged between two rebuilds) counts a
+// connect. The daemon's first snapshot only fills the table.
+static void trackDeviceMetrics(const DeviceSnapshot *snap, bool countChanges) {
+    unsigned count = atomic_load_explicit(&metrics.deviceCount, memory_order_relaxed);
+    bool *seen = tracedCalloc(snap->count ? snap->count : 1, sizeof(bool));
+    if (!seen) {
+        return;
+    }
+    for (unsigned i = 0; i < count; i++) {
+        DeviceMetrics *device = &metrics.devices[i];
+        const DeviceInfo *info = NULL;
+        for (UInt32 j = 0; j < snap->count && !info; j++) {
+            if (snap->devices[j].uid && strcmp(snap->devices[j].uid, device->uid) == 0) {
+                info = &snap->devices[j];
+                seen[j] = true;
+            }
+        }
+        AudioDeviceID id = info ? info->id : kAudioObjectUnknown;
+        if (device->id != id && device->id != kAudioObjectUnknown && countChanges) {
+            atomic_fetch_add_explicit(&device->counters[DEVICE_DISCONNECTS], 1, memory_order_relaxed);
+        }
+        if (device->id != id && id != kAudioObjectUnknown && countChanges) {
+            atomic_fetch_add_explicit(&device->counters[DEVICE_CONNECTS], 1, memory_order_relaxed);
+        }
+        device->id = id;
+    }
 
-    AudioDeviceID dev = findDeviceByName(deviceName);
-    if (dev == kAudioObjectUnknown) {
-        fprintf(stderr, "Device \"%s\" not found.\n", deviceName);
-        fprintf(stderr, "Use '%s -l' to list available devices.\n", argv[0]);
-        return 1;
+    unsigned dropped = 0;
+    for (UInt32 j = 0; j < snap->count; j++) {
+        const DeviceInfo *info = &snap->devices[j];
+        if (seen[j] || !info->uid) {
+            continue;
+        }
+        if (count == METRICS_MAX_DEVICES) {
+            if (!metrics.overflowLogged) {
+                fprintf(stderr, "Metrics table full (%d devices); not tracking \"%s\" or later new devices\n",
+                        METRICS_MAX_DEVICES, info->name ? info->name : info->uid);
+                metrics.overflowLogged = true;
+            }
+            dropped++;
+            continue;
+        }
+        DeviceMetrics *device = &metrics.devices[count];
+        device->uid = strdup(info->uid);
+        device->name = strdup(info->name ? info->name : "");
+        if (!device->uid || !device->name) {
+            free(device->uid);
+            free(device->name);
+            break;
+        }
+        device->id = info->id;
+        if (countChanges) {
+            atomic_store_explicit(&device->counters[DEVICE_CONNECTS], 1, memory_order_relaxed);
+        }
+        atomic_store_explicit(&metrics.deviceCount, ++count, memory_order_release);
     }
+    atomic_store_explicit(&metrics.droppedDevices, dropped, memory_order_relaxed);
+    free(seen);
+}
 
-    OSStatus err = setDefaultOutputDevice(dev);
-    if (err != noErr) {
-        fprintf(stderr, "Failed to set default output device: %d\n", (int)err);
-        return 1;
+static void writeLabelValue(const char *value, FILE *out) {
+    for (const char *p = value; *p; p++) {
+        if (*p == '\\' || *p == '"') {
+            fprintf(out, "\\%c", *p);
+        } else if (*p == '\n') {
+            fputs("\\n", out);
+        } else {
+            fputc(*p, out);
+        }
     }
+}
 
-    printf("Switched default output to \"%s\".\n", deviceName);
-    return 0;
+// One histogram's samples, labelled with the operation and, for a device
+// histogram, deviceLabels.
+static void writeHistogram(const char *metric, const char *deviceLabels, MetricOp op, const Histogram *histogram,
+                           FILE *out) {
+    char labels[1024];
+    if ((size_t)snprintf(labels, sizeof(labels), "%s%sop=\"%s\"", deviceLabels ? deviceLabels : "",
+                         deviceLabels ? "," : "", metricOpNames[op]) >= sizeof(labels)) {
+        return;
+    }
+    unsigned long long cumulative = 0;
+    for (size_t i = 0; i < METRIC_BUCKET_COUNT; i++) {
+        cumulative += atomic_load_explicit(&histogram->buckets[i], memory_order_relaxed);
+        if (i < METRIC_BUCKET_COUNT - 1) {
+            fprintf(out, "%s_bucket{%s,le=\"%g\"} %llu\n", metric, labels, metricBucketMicros[i] / 1e6, cumulative);
+        } else {
+            fprintf(out, "%s_bucket{%s,le=\"+Inf\"} %llu\n", metric, labels, cumulative);
+        }
+    }
+    fprintf(out, "%s_sum{%s} %.6f\n", metric, labels,
+            atomic_load_explicit(&histogram->sumMicros, memory_order_relaxed) / 1e6);
+    fprintf(out, "%s_count{%s} %llu\n", metric, labels,
+            atomic_load_explicit(&histogram->count, memory_order_relaxed));
+}
+
+// uid="...",name="..." for a device, escaped.
+static char* copyDeviceLabels(const DeviceMetrics *device) {
+    char *labels = NULL;
+    size_t len = 0;
+    FILE *buf = open_memstream(&labels, &len);
+    if (!buf) {
+        return NULL;
+    }
+    fputs("uid=\"", buf);
+    writeLabelValue(device->uid, buf);
+    fputs("\",name=\"", buf);
+    writeLabelValue(device->name, buf);
+    fputc('"', buf);
+    fclose(buf);
+    return labels;
+}
+
+static void writeMetrics(FILE *out) {
+    fprintf(out, "# HELP switch_audio_operation_duration_seconds Time spent per operation.\n");
+    fprintf(out, "# TYPE switch_audio_operation_duration_seconds histogram\n");
+    for (int op = 0; op < METRIC_OP_COUNT; op++) {
+        writeHistogram("switch_audio_operation_duration_seconds", NULL, (MetricOp)op, &metrics.ops[op], out);
+    }
+
+    unsigned count = atomic_load_explicit(&metrics.deviceCount, memory_order_acquire);
+    fprintf(out, "# HELP switch_audio_device_operation_duration_seconds Time spent per operation on one device.\n");
+    fprintf(out, "# TYPE switch_audio_device_operation_duration_seconds histogram\n");
+    for (unsigned i = 0; i < count; i++) {
+        char *deviceLabels = copyDeviceLabels(&metrics.devices[i]);
+        for (int op = 0; deviceLabels && op < METRIC_OP_COUNT; op++) {
+            if (atomic_load_explicit(&metrics.devices[i].ops[op].count, memory_order_relaxed) == 0) {
+                continue;
+            }
+            writeHistogram("switch_audio_device_operation_duration_seconds", deviceLabels, (MetricOp)op,
+                           &metrics.devices[i].ops[op], out);
+        }
+        free(deviceLabels);
+    }
+
+    for (int counter = 0; counter < DEVICE_COUNTER_COUNT; counter++) {
+        const char *metric = deviceCounterInfo[counter].metric;
+        fprintf(out, "# HELP %s %s\n", metric, deviceCounterInfo[counter].help);
+        fprintf(out, "# TYPE %s counter\n", metric);
+        for (unsigned i = 0; i < count; i++) {
+            char *deviceLabels = copyDeviceLabels(&metrics.devices[i]);
+            if (deviceLabels) {
+                fprintf(out, "%s{%s} %lu\n", metric, deviceLabels,
+                        atomic_load_explicit(&metrics.devices[i].counters[counter], memory_order_relaxed));
+                free(deviceLabels);
+            }
+        }
+    }
+
+    fprintf(out, "# HELP switch_audio_metrics_dropped_devices Connected devices the per-device table has no "
+                 "room for.\n");
+    fprintf(out, "# TYPE switch_audio_metrics_dropped_devices gauge\n");
+    fprintf(out, "switch_audio_metrics_dropped_devices %u\n",
+            atomic_load_explicit(&metrics.droppedDevices, memory_order_relaxed));
+    fprintf(out, "# HELP switch_audio_set_failures_total Failed attempts to change a default device.\n");
+    fprintf(out, "# TYPE switch_audio_set_failures_total counter\n");
+    fprintf(out, "switch_audio_set_failures_total %lu\n",
+            atomic_load_explicit(&metrics.setFailures, memory_order_relaxed));
+    fprintf(out, "# HELP switch_audio_requests_total Commands run by the daemon.\n");
+    fprintf(out, "# TYPE switch_audio_requests_total counter\n");
+    for (int source = 0; source < REQUEST_SOURCE_COUNT; source++) {
+        fprintf(out, "switch_audio_requests_total{source=\"%s\"} %lu\n", requestSourceNames[source],
+                atomic_load_explicit(&metrics.requests[source], memory_order_relaxed));
+    }
+    fprintf(out, "# HELP switch_audio_request_failures_total Commands that exited with a non-zero status.\n");
+    fprintf(out, "# TYPE switch_audio_request_failures_total counter\n");
+    for (int source = 0; source < REQUEST_SOURCE_COUNT; source++) {
+        fprintf(out, "switch_audio_request_failures_total{source=\"%s\"} %lu\n", requestSourceNames[source],
+                atomic_load_explicit(&metrics.requestFailures[source], memory_order_relaxed));
+    }
+    fprintf(out, "# HELP switch_audio_snapshot_rebuilds_total Device table rebuilds after hotplug events.\n");
+    fprintf(out, "# TYPE switch_audio_snapshot_rebuilds_total counter\n");
+    fprintf(out, "switch_audio_snapshot_rebuilds_total %lu\n",
+            atomic_load_explicit(&metrics.rebuilds, memory_order_relaxed));
+    fprintf(out, "# HELP switch_audio_uptime_seconds Seconds since the daemon started.\n");
+    fprintf(out, "# TYPE switch_audio_uptime_seconds gauge\n");
+    fprintf(out, "switch_audio_uptime_seconds %ld\n", (long)(time(NULL) - metricsStartTime));
+}
+
+// ---------------------------------------------------------------------------
+// Parallel device probing
+//
+// Each device is probed (stream layout, UID, name) on a small set of GCD
+// workers, so one wedged device cannot stall enumeration. A probe that runs
+// longer than the per-device timeout is abandoned and its device is marked
+// unresponsive; results are merged back in HAL order either way. Abandoned
+// workers may still be blocked inside the HAL, so the shared batch is
+// reference-counted and the last party out frees it.
+// ---------------------------------------------------------------------------
+
+#define PROBE_MAX_WORKERS 8
+#define DEFAULT_PROBE_TIMEOUT_MS 500
+
+enum {
+    PROBE_PENDING,
+    PROBE_RUNNING,
+    PROBE_DONE,
+    PROBE_CLAIMED
+};
+
+// Typical UIDs and names fit; longer ones spill to the heap.
+#define PROBE_STRING_INLINE 128
+
+typedef struct {
+    atomic_int state;
+    UInt64 startTicks;      // written before state becomes PROBE_RUNNING
+    DeviceInfo info;        // uid/name point into the buffers below or the heap
+    char uidBuf[PROBE_STRING_INLINE];
+    char nameBuf[PROBE_STRING_INLINE];
+} ProbeSlot;
+
+typedef struct {
+    atomic_int refs;
+    atomic_uint next;
+    UInt32 count;
+    dispatch_semaphore_t progress;
+    TransportFilter filter;     // a copy: stragglers outlive the caller
+    ProbeSlot slots[];
+} ProbeBatch;
+
+// The transport type comes first: it is a 4-byte read, and a device the
+// filter rejects needs nothing else.
+static void probeDevice(ProbeSlot *slot, const TransportFilter *filter) {
+    DeviceInfo *info = &slot->info;
+    AudioDeviceID deviceID = info->id;
+    os_signpost_id_t signpost = traceSignpostID();
+    TRACE_BEGIN(signpost, "probe", "device %u", (unsigned)deviceID);
+    getUInt32Property(deviceID, kAudioDevicePropertyTransportType,
+                      kAudioObjectPropertyScopeGlobal, &info->transportType);
+    if (!transportAllowed(filter, info->transportType)) {
+        info->hidden = true;
+        TRACE_END(signpost, "probe", "filtered");
+        return;
+    }
+    info->hasOutput = deviceSupportsScope(deviceID, kAudioDevicePropertyScopeOutput, &info->outputChannels);
+    info->hasInput = deviceSupportsScope(deviceID, kAudioDevicePropertyScopeInput, &info->inputChannels);
+    if (info->hasOutput || info->hasInput) {
+        info->uid = getDeviceStringProperty(deviceID, kAudioDevicePropertyDeviceUID,
+                                            slot->uidBuf, sizeof(slot->uidBuf));
+        info->name = getDeviceStringProperty(deviceID, kAudioObjectPropertyName,
+                                             slot->nameBuf, sizeof(slot->nameBuf));
+        info->sampleRate = getNominalSampleRate(deviceID);
+    }
+    TRACE_END(signpost, "probe");
+}
+
+static void releaseProbeBatch(ProbeBatch *batch) {
+    if (atomic_fetch_sub(&batch->refs, 1) != 1) {
+        return;
+    }
+    // Claimed strings were copied into the snapshot; unclaimed ones belong to
+    // probes that finished after the timeout. Either way only spills are freed.
+    for (UInt32 i = 0; i < batch->count; i++) {
+        ProbeSlot *slot = &batch->slots[i];
+        int state = atomic_load(&slot->state);
+        if (state == PROBE_DONE || state == PROBE_CLAIMED) {
+            if (slot->info.uid != slot->uidBuf) {
+                free(slot->info.uid);
+            }
+            if (slot->info.name != slot->nameBuf) {
+                free(slot->info.name);
+            }
+        }
+    }
+    dispatch_release(batch->progress);
+    free(batch);
+}
+
+static void probeWorker(void *context) {
+    ProbeBatch *batch = context;
+    for (;;) {
+        UInt32 i = atomic_fetch_add(&batch->next, 1);
+        if (i >= batch->count) {
+            break;
+        }
+        ProbeSlot *slot = &batch->slots[i];
+        slot->startTicks = mach_absolute_time();
+        atomic_store(&slot->state, PROBE_RUNNING);
+        probeDevice(slot, &batch->filter);
+        atomic_store(&slot->state, PROBE_DONE);
+        dispatch_semaphore_signal(batch->progress);
+    }
+    releaseProbeBatch(batch);
+}
+
+static long getProbeTimeoutMs(void) {
+    const char *env = getenv("SWITCH_AUDIO_PROBE_TIMEOUT_MS");
+    if (env && *env) {
+        char *end;
+        long ms = strtol(env, &end, 10);
+        if (*end == '\0' && ms > 0) {
+            return ms;
+        }
+    }
+    return DEFAULT_PROBE_TIMEOUT_MS;
+}
+
+// Blocks until every probe has finished or timed out, or until every worker
+// is stuck so the remaining devices can never be picked up.
+static void awaitProbes(ProbeBatch *batch, UInt32 workers, UInt64 timeout) {
+    for (;;) {
+        UInt64 now = mach_absolute_time();
+        UInt64 nextDeadline = now + timeout;
+        UInt32 settled = 0, stuck = 0;
+
+        for (UInt32 i = 0; i < batch->count; i++) {
+            ProbeSlot *slot = &batch->slots[i];
+            int state = atomic_load(&slot->state);
+            if (state == PROBE_DONE) {
+                settled++;
+            } else if (state == PROBE_RUNNING) {
+                UInt64 deadline = slot->startTicks + timeout;
+                if (now >= deadline) {
+                    settled++;
+                    stuck++;
+                } else if (deadline < nextDeadline) {
+                    nextDeadline = deadline;
+                }
+            }
+        }
+
+        if (settled == batch->count || stuck >= workers) {
+            return;
+        }
+
+        UInt64 waitNanos = (UInt64)(ticksToMicros(nextDeadline - now) * 1000.0) + 1;
+        dispatch_semaphore_wait(batch->progress, dispatch_time(DISPATCH_TIME_NOW, (int64_t)waitNanos));
+    }
+}
+
+// Probes every device in the list against the HAL.
+static OSStatus fillDeviceSnapshot(DeviceSnapshot *snap, const AudioDeviceID *devices, UInt32 deviceCount,
+                                   const TransportFilter *filter) {
+    memset(snap, 0, sizeof(*snap));
+    snap->devices = arenaCalloc(&snap->arena, deviceCount ? deviceCount : 1, sizeof(DeviceInfo));
+    ProbeBatch *batch = tracedCalloc(1, sizeof(ProbeBatch) + deviceCount * sizeof(ProbeSlot));
+    dispatch_semaphore_t progress = dispatch_semaphore_create(0);
+    if (!snap->devices || !batch || !progress) {
+        freeDeviceSnapshot(snap);
+        free(batch);
+        if (progress) {
+            dispatch_release(progress);
+        }
+        return kAudioHardwareBadDeviceError;
+    }
+
+    UInt32 workers = deviceCount < PROBE_MAX_WORKERS ? deviceCount : PROBE_MAX_WORKERS;
+    batch->count = deviceCount;
+    batch->progress = progress;
+    if (filter) {
+        batch->filter = *filter;
+    }
+    atomic_init(&batch->refs, (int)workers + 1);
+    atomic_init(&batch->next, 0);
+    for (UInt32 i = 0; i < deviceCount; i++) {
+        atomic_init(&batch->slots[i].state, PROBE_PENDING);
+        batch->slots[i].info.id = devices[i];
+    }
+
+    dispatch_queue_t queue = dispatch_get_global_queue(QOS_CLASS_USER_INITIATED, 0);
+    for (UInt32 i = 0; i < workers; i++) {
+        dispatch_async_f(queue, batch, probeWorker);
+    }
+    awaitProbes(batch, workers, millisToTicks(getProbeTimeoutMs()));
+
+    for (UInt32 i = 0; i < deviceCount; i++) {
+        ProbeSlot *slot = &batch->slots[i];
+        DeviceInfo *info = &snap->devices[i];
+        int expected = PROBE_DONE;
+        if (atomic_compare_exchange_strong(&slot->state, &expected, PROBE_CLAIMED)) {
+            *info = slot->info;
+            info->uid = arenaStrdup(&snap->arena, slot->info.uid);
+            info->name = arenaStrdup(&snap->arena, slot->info.name);
+            snap->partial |= info->hidden;
+        } else {
+            info->id = devices[i];
+            info->unresponsive = true;
+            snap->unresponsiveCount++;
+        }
+    }
+    snap->count = deviceCount;
+    releaseProbeBatch(batch);
+
+    return finishDeviceSnapshot(snap);
+}
+
+static OSStatus buildDeviceSnapshot(DeviceSnapshot *snap) {
+    UInt64 start = mach_absolute_time();
+    DeviceList list;
+    OSStatus err = getAudioDeviceList(&list);
+    if (err != noErr) {
+        return err;
+    }
+
+    err = fillDeviceSnapshot(snap, list.ids, list.count, NULL);
+    freeDeviceList(&list);
+    if (err == noErr) {
+        recordOperation(METRIC_ENUMERATE, kAudioObjectUnknown, start);
+    }
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// On-disk snapshot cache
+//
+// The last snapshot is kept in ~/Library/Caches/switch_audio/devices.bin so a
+// one-shot invocation can skip the per-device capability/UID/name queries.
+// It is trusted only while the HAL device list (one kAudioHardwarePropertyDevices
+// read) and the boot time both match what was recorded; device IDs are not
+// stable across reboots. The default device is always read live.
+//
+// Layout: CacheHeader, then count CacheRecords, then the member indices of
+// the last rotation set resolved (cycleCount UInt32s), then a pool of
+// NUL-terminated strings that the records reference by offset. The nominal
+// sample rate is not stored: it changes without the device list changing.
+// ---------------------------------------------------------------------------
+
+#define CACHE_MAGIC 0x53574143u   // 'SWAC'
+#define CACHE_VERSION 4
+#define CACHE_NO_STRING UINT32_MAX
+
+typedef struct {
+    UInt32 magic;
+    UInt32 version;
+    UInt32 count;
+    UInt32 stringBytes;
+    SInt64 bootTime;
+    UInt32 cycleCount;
+    UInt32 cycleRole;
+    UInt32 cycleKeyOffset;      // CACHE_NO_STRING without a stored set
+    UInt32 reserved;
+    ConfigStamp cycleSetStamp;
+    ConfigStamp cycleAliasStamp;
+} CacheHeader;
+
+typedef struct {
+    AudioDeviceID id;
+    UInt32 hasOutput;
+    UInt32 hasInput;
+    UInt32 outputChannels;
+    UInt32 inputChannels;
+    UInt32 transportType;
+    UInt32 uidOffset;
+    UInt32 nameOffset;
+} CacheRecord;
+
+static SInt64 getBootTime(void) {
+    struct timeval boot;
+    size_t size = sizeof(boot);
+    if (sysctlbyname("kern.boottime", &boot, &size, NULL, 0) != 0) {
+        return 0;
+    }
+    return (SInt64)boot.tv_sec;
+}
+
+static bool getCachePath(char *path, size_t size, bool createDir) {
+    const char *override = getenv("SWITCH_AUDIO_CACHE");
+    if (override && *override) {
+        return (size_t)snprintf(path, size, "%s", override) < size;
+    }
+
+    const char *home = getenv("HOME");
+    if (!home || !*home) {
+        return false;
+    }
+    if ((size_t)snprintf(path, size, "%s/Library/Caches/switch_audio", home) >= size) {
+        return false;
+    }
+    if (createDir) {
+        mkdir(path, 0755);
+    }
+    size_t len = strlen(path);
+    return (size_t)snprintf(path + len, size - len, "/devices.bin") < size - len;
+}
+
+static const char* cachedString(const char *pool, UInt32 poolSize, UInt32 offset) {
+    if (offset == CACHE_NO_STRING || offset >= poolSize) {
+        return NULL;
+    }
+    const char *str = pool + offset;
+    return memchr(str, '\0', poolSize - offset) ? str : NULL;
+}
+
+static char* copyCachedString(Arena *arena, const char *pool, UInt32 poolSize, UInt32 offset) {
+    const char *str = cachedString(pool, poolSize, offset);
+    return str ? arenaStrdup(arena, str) : NULL;
+}
+
+static const UInt32* cachedCycleMembers(const CacheHeader *header) {
+    return (const UInt32 *)((const CacheRecord *)(header + 1) + header->count);
+}
+
+static const char* cachedStringPool(const CacheHeader *header) {
+    return (const char *)(cachedCycleMembers(header) + header->cycleCount);
+}
+
+// Restores the stored rotation set; resolveRotationCycle() decides whether
+// the config files still match it.
+static void readCachedCycle(DeviceSnapshot *snap, const CacheHeader *header) {
+    char *key = copyCachedString(&snap->arena, cachedStringPool(header), header->stringBytes,
+                                 header->cycleKeyOffset);
+    if (!key || header->cycleCount == 0 || header->cycleRole >= ROLE_COUNT) {
+        return;
+    }
+    const UInt32 *stored = cachedCycleMembers(header);
+    UInt32 *members = arenaAlloc(&snap->arena, header->cycleCount * sizeof(UInt32));
+    if (!members) {
+        return;
+    }
+    for (UInt32 i = 0; i < header->cycleCount; i++) {
+        if (stored[i] >= snap->count) {
+            return;
+        }
+        members[i] = stored[i];
+    }
+    snap->cycle = (RotationCycle){
+        .setKey = key,
+        .role = (DeviceRole)header->cycleRole,
+        .setStamp = header->cycleSetStamp,
+        .aliasStamp = header->cycleAliasStamp,
+        .stored = true,
+        .members = members,
+        .count = header->cycleCount
+    };
+}
+
+// Maps the cache file and checks everything that can be checked without the
+// HAL: format, size and boot time. Returns NULL for a missing or stale file;
+// otherwise the caller unmaps *mapSize bytes when done.
+static const CacheHeader* mapCacheFile(size_t *mapSize) {
+    char path[1024];
+    if (!getCachePath(path, sizeof(path), false)) {
+        return NULL;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return NULL;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(CacheHeader)) {
+        close(fd);
+        return NULL;
+    }
+    *mapSize = (size_t)st.st_size;
+    void *map = mmap(NULL, *mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return NULL;
+    }
+
+    const CacheHeader *header = map;
+    size_t expected = sizeof(*header) + (size_t)header->count * sizeof(CacheRecord)
+        + (size_t)header->cycleCount * sizeof(UInt32) + header->stringBytes;
+    if (header->magic != CACHE_MAGIC || header->version != CACHE_VERSION || expected != *mapSize
+        || header->bootTime != getBootTime()) {
+        munmap(map, *mapSize);
+        return NULL;
+    }
+    return header;
+}
+
+static bool readCachedSnapshot(DeviceSnapshot *snap, const AudioDeviceID *devices, UInt32 deviceCount) {
+    size_t mapSize;
+    const CacheHeader *header = mapCacheFile(&mapSize);
+    if (!header) {
+        return false;
+    }
+
+    const CacheRecord *records = (const CacheRecord *)(header + 1);
+    bool usable = header->count == deviceCount;
+    for (UInt32 i = 0; usable && i < deviceCount; i++) {
+        usable = records[i].id == devices[i];
+    }
+
+    bool loaded = false;
+    if (usable) {
+        memset(snap, 0, sizeof(*snap));
+        snap->devices = arenaCalloc(&snap->arena, deviceCount ? deviceCount : 1, sizeof(DeviceInfo));
+        if (snap->devices) {
+            const char *pool = cachedStringPool(header);
+            for (UInt32 i = 0; i < deviceCount; i++) {
+                DeviceInfo *info = &snap->devices[i];
+                info->id = records[i].id;
+                info->hasOutput = records[i].hasOutput != 0;
+                info->hasInput = records[i].hasInput != 0;
+                info->outputChannels = records[i].outputChannels;
+                info->inputChannels = records[i].inputChannels;
+                info->transportType = records[i].transportType;
+                info->uid = copyCachedString(&snap->arena, pool, header->stringBytes, records[i].uidOffset);
+                info->name = copyCachedString(&snap->arena, pool, header->stringBytes, records[i].nameOffset);
+            }
+            snap->count = deviceCount;
+            loaded = finishDeviceSnapshot(snap) == noErr;
+            if (loaded) {
+                readCachedCycle(snap, header);
+            }
+        } else {
+            freeDeviceSnapshot(snap);
+        }
+    }
+
+    munmap((void *)header, mapSize);
+    return loaded;
+}
+
+// Fills the snapshot from the cache when it describes exactly this device
+// list. Any mismatch or corruption simply reports a miss.
+static bool loadCachedSnapshot(DeviceSnapshot *snap, const AudioDeviceID *devices, UInt32 deviceCount) {
+    os_signpost_id_t signpost = traceSignpostID();
+    TRACE_BEGIN(signpost, "cache-load");
+    bool loaded = readCachedSnapshot(snap, devices, deviceCount);
+    TRACE_END(signpost, "cache-load", "%s", loaded ? "hit" : "miss");
+    return loaded;
+}
+
+static UInt32 appendCachedString(FILE *pool, const char *str, UInt32 *poolSize) {
+    if (!str) {
+        return CACHE_NO_STRING;
+    }
+    UInt32 offset = *poolSize;
+    size_t len = strlen(str) + 1;
+    fwrite(str, 1, len, pool);
+    *poolSize += (UInt32)len;
+    return offset;
+}
+
+// Best effort: a cache that cannot be written just means the next run probes
+// the HAL again. Written to a temporary file and renamed so concurrent
+// readers never map a half-written cache.
+static void saveCachedSnapshot(const DeviceSnapshot *snap) {
+    char path[1024], tmpPath[1100];
+    // A device that timed out would otherwise stay invisible until the next
+    // hotplug changes the device list.
+    if (snap->unresponsiveCount > 0 || snap->partial || !getCachePath(path, sizeof(path), true)) {
+        return;
+    }
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+
+    CacheRecord *records = tracedCalloc(snap->count ? snap->count : 1, sizeof(CacheRecord));
+    char *poolBuf = NULL;
+    size_t poolLen = 0;
+    FILE *pool = open_memstream(&poolBuf, &poolLen);
+    if (!records || !pool) {
+        free(records);
+        if (pool) {
+            fclose(pool);
+        }
+        free(poolBuf);
+        return;
+    }
+
+    // Only a set resolved without a transport filter describes the snapshot
+    // a later run loads.
+    const RotationCycle *cycle = &snap->cycle;
+    bool storeCycle = cycle->setKey && cycle->count > 0 && !snap->filtered;
+    UInt32 poolSize = 0;
+    UInt32 cycleKeyOffset = storeCycle ? appendCachedString(pool, cycle->setKey, &poolSize) : CACHE_NO_STRING;
+    for (UInt32 i = 0; i < snap->count; i++) {
+        const DeviceInfo *info = &snap->devices[i];
+        records[i].id = info->id;
+        records[i].hasOutput = info->hasOutput;
+        records[i].hasInput = info->hasInput;
+        records[i].outputChannels = info->outputChannels;
+        records[i].inputChannels = info->inputChannels;
+        records[i].transportType = info->transportType;
+        records[i].uidOffset = appendCachedString(pool, info->uid, &poolSize);
+        records[i].nameOffset = appendCachedString(pool, info->name, &poolSize);
+    }
+    fclose(pool);
+
+    CacheHeader header = {
+        .magic = CACHE_MAGIC,
+        .version = CACHE_VERSION,
+        .count = snap->count,
+        .stringBytes = poolSize,
+        .bootTime = getBootTime(),
+        .cycleCount = storeCycle ? cycle->count : 0,
+        .cycleRole = storeCycle ? cycle->role : 0,
+        .cycleKeyOffset = cycleKeyOffset,
+        .cycleSetStamp = storeCycle ? cycle->setStamp : (ConfigStamp){ 0 },
+        .cycleAliasStamp = storeCycle ? cycle->aliasStamp : (ConfigStamp){ 0 }
+    };
+
+    int fd = open(tmpPath, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd >= 0) {
+        bool ok = writeAll(fd, &header, sizeof(header))
+            && writeAll(fd, records, snap->count * sizeof(CacheRecord))
+            && writeAll(fd, cycle->members, header.cycleCount * sizeof(UInt32))
+            && writeAll(fd, poolBuf, poolSize);
+        close(fd);
+        if (!ok || rename(tmpPath, path) != 0) {
+            unlink(tmpPath);
+        }
+    }
+
+    free(records);
+    free(poolBuf);
+}
+
+static bool cacheEnabled(void) {
+    const char *noCache = getenv("SWITCH_AUDIO_NO_CACHE");
+    return !noCache || !*noCache;
+}
+
+// Snapshot for one-shot invocations: a single device-list read, then either
+// the cached per-device data or a probe that refreshes the cache. A cache
+// miss probes every device so the next run, filtered or not, can use the
+// result; the caller applies the filter afterwards. Only with the cache off
+// does the filter reach the probe and skip work for rejected devices.
+
+static OSStatus acquireDeviceSnapshot(DeviceSnapshot *snap, const TransportFilter *filter) {
+    bool useCache = cacheEnabled();
+
+    DeviceList list;
+    OSStatus err = getAudioDeviceList(&list);
+    if (err != noErr) {
+        return err;
+    }
+
+    if (!useCache || !loadCachedSnapshot(snap, list.ids, list.count)) {
+        err = fillDeviceSnapshot(snap, list.ids, list.count, useCache ? NULL : filter);
+        if (err == noErr && useCache) {
+            saveCachedSnapshot(snap);
+        }
+    }
+
+    freeDeviceList(&list);
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// Device listing
+//
+// -l prints names for people; --format json|tsv|nul prints every field the
+// snapshot holds for scripts: ID, UID, name, transport, output channels,
+// nominal sample rate and whether the device is the default output. tsv and
+// nul share one field order; nul terminates every field with a NUL byte
+// (seven per device, for xargs -0 -n7) so any name survives intact.
+// ---------------------------------------------------------------------------
+
+typedef enum {
+    FORMAT_TEXT,
+    FORMAT_JSON,
+    FORMAT_TSV,
+    FORMAT_NUL
+} OutputFormat;
+
+static bool parseOutputFormat(const char *arg, OutputFormat *format) {
+    if (strcmp(arg, "text") == 0) {
+        *format = FORMAT_TEXT;
+    } else if (strcmp(arg, "json") == 0) {
+        *format = FORMAT_JSON;
+    } else if (strcmp(arg, "tsv") == 0) {
+        *format = FORMAT_TSV;
+    } else if (strcmp(arg, "nul") == 0) {
+        *format = FORMAT_NUL;
+    } else {
+        return false;
+    }
+    return true;
+}
+
+static void writeJSONString(FILE *out, const char *str) {
+    fputc('"', out);
+    for (const unsigned char *p = (const unsigned char *)str; *p; p++) {
+        switch (*p) {
+        case '"':
+            fputs("\\\"", out);
+            break;
+        case '\\':
+            fputs("\\\\", out);
+            break;
+        case '\n':
+            fputs("\\n", out);
+            break;
+        case '\t':
+            fputs("\\t", out);
+            break;
+        default:
+            if (*p < 0x20) {
+                fprintf(out, "\\u%04x", *p);
+            } else {
+                fputc(*p, out);
+            }
+        }
+    }
+    fputc('"', out);
+}
+
+
+// Cached snapshots and the daemon's long-lived one leave rates unknown, so
+// they are read here, once per listed device, only when a format shows them.
+static void ensureSampleRates(DeviceSnapshot *snap) {
+    for (UInt32 i = 0; i < snap->count; i++) {
+        DeviceInfo *info = &snap->devices[i];
+        if ((info->hasOutput || info->hasInput) && !info->unresponsive && info->sampleRate == 0) {
+            info->sampleRate = getNominalSampleRate(info->id);
+        }
+    }
+}
+
+// Rates, buffer sizes and latencies can change without any device-list
+// notification, so the daemon drops them before every request.
+static void forgetLiveProperties(DeviceSnapshot *snap) {
+    for (UInt32 i = 0; i < snap->count; i++) {
+        snap->devices[i].sampleRate = 0;
+        snap->devices[i].latencyKnown = false;
+    }
+}
+
+// Tabs and newlines would split a tsv record, so they become spaces.
+static void writeTSVField(FILE *out, const char *str) {
+    for (const char *p = str; *p; p++) {
+        fputc(*p == '\t' || *p == '\n' || *p == '\r' ? ' ' : *p, out);
+    }
+}
+
+static void writeDeviceRecord(const DeviceSnapshot *snap, const DeviceInfo *info, DeviceRole role,
+                              OutputFormat format, bool first, FILE *out) {
+    bool isDefault = info->id == snap->defaults[role];
+    if (format == FORMAT_JSON) {
+        fprintf(out, "%s\n  {\"id\":%u", first ? "" : ",", (unsigned)info->id);
+        if (info->unresponsive) {
+            fprintf(out, ",\"responding\":false,\"default\":%s}", isDefault ? "true" : "false");
+            return;
+        }
+        fputs(",\"uid\":", out);
+        writeJSONString(out, info->uid ? info->uid : "");
+        fputs(",\"name\":", out);
+        writeJSONString(out, info->name);
+        fprintf(out, ",\"transport\":\"%s\",\"channels\":%u,\"sampleRate\":%g,\"responding\":true,\"default\":%s}",
+                transportTypeName(info->transportType), (unsigned)deviceChannels(info, role),
+                info->sampleRate, isDefault ? "true" : "false");
+        return;
+    }
+
+    char sep = format == FORMAT_NUL ? '\0' : '\t';
+    const char *uid = info->uid ? info->uid : "";
+    const char *name = info->name ? info->name : "";
+    const char *transport = info->unresponsive ? "unresponsive" : transportTypeName(info->transportType);
+    fprintf(out, "%u%c", (unsigned)info->id, sep);
+    if (format == FORMAT_TSV) {
+        writeTSVField(out, uid);
+        fputc(sep, out);
+        writeTSVField(out, name);
+        fputc(sep, out);
+    } else {
+        fprintf(out, "%s%c%s%c", uid, sep, name, sep);
+    }
+    fprintf(out, "%s%c%u%c%g%c%d%c", transport, sep, (unsigned)deviceChannels(info, role), sep,
+            info->sampleRate, sep, isDefault ? 1 : 0, format == FORMAT_NUL ? '\0' : '\n');
+}
+
+static void writeDeviceList(const DeviceSnapshot *snap, DeviceRole role, OutputFormat format, FILE *out) {
+    static const char *const titles[ROLE_COUNT] = {
+        "Available Audio Output Devices:",
+        "Available Audio Input Devices:",
+        "Available System Output Devices:"
+    };
+    if (format == FORMAT_TEXT) {
+        fprintf(out, "%s\n", titles[role]);
+        fprintf(out, "%.*s\n", (int)strlen(titles[role]) + 1, "=======================================");
+    } else if (format == FORMAT_JSON) {
+        fputc('[', out);
+    }
+
+    bool first = true;
+    for (UInt32 i = 0; i < snap->count; ++i) {
+        const DeviceInfo *info = &snap->devices[i];
+
+        // Only show devices that can take the role
+        if (info->hidden || (!info->unresponsive && (!deviceHasRole(info, role) || !info->name))) {
+            continue;
+        }
+
+        if (format != FORMAT_TEXT) {
+            writeDeviceRecord(snap, info, role, format, first, out);
+        } else if (info->unresponsive) {
+            fprintf(out, "%c [device %u not responding]\n",
+                    info->id == snap->defaults[role] ? '*' : ' ', (unsigned)info->id);
+        } else if (info->id == snap->defaults[role]) {
+            fprintf(out, "* %s\n", info->name);
+        } else {
+            fprintf(out, "  %s\n", info->name);
+        }
+        first = false;
+    }
+
+    if (format == FORMAT_JSON) {
+        fputs(first ? "]\n" : "\n]\n", out);
+    }
+}
+
+// The listing is assembled in memory and handed to the output stream in one
+// write, so a consumer never sees a partial table.
+static void listAudioDevices(DeviceSnapshot *snap, DeviceRole role, OutputFormat format, FILE *out) {
+    if (format != FORMAT_TEXT) {
+        ensureSampleRates(snap);
+    }
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (!mem) {
+        writeDeviceList(snap, role, format, out);
+        return;
+    }
+    writeDeviceList(snap, role, format, mem);
+    fclose(mem);
+    fwrite(buf, 1, len, out);
+    free(buf);
+}
+
+// Effective latency of a device for one direction, the way the HAL adds it up
+// for an IOProc: device latency + safety offset + one I/O buffer + the
+// largest stream latency. Read in a single pass over the snapshot, only when
+// --latency asks, and kept until the daemon's next request.
+static UInt32 getDeviceFrames(AudioObjectID objectID, AudioObjectPropertySelector selector,
+                              AudioObjectPropertyScope scope) {
+    AudioObjectPropertyAddress addr = { selector, scope, kAudioObjectPropertyElementMain };
+    UInt32 frames = 0;
+    UInt32 size = sizeof(frames);
+    if (halGetPropertyData(objectID, &addr, 0, NULL, &size, &frames) != noErr) {
+        return 0;
+    }
+    return frames;
+}
+
+static UInt32 getMaxStreamLatency(AudioDeviceID deviceID, AudioObjectPropertyScope scope) {
+    AudioObjectPropertyAddress addr = { kAudioDevicePropertyStreams, scope, kAudioObjectPropertyElementMain };
+    AudioStreamID streams[16];
+    UInt32 size = sizeof(streams);
+    if (halGetPropertyData(deviceID, &addr, 0, NULL, &size, streams) != noErr) {
+        return 0;
+    }
+    UInt32 latency = 0;
+    for (UInt32 i = 0; i < size / sizeof(AudioStreamID); i++) {
+        UInt32 frames = getDeviceFrames(streams[i], kAudioStreamPropertyLatency, kAudioObjectPropertyScopeGlobal);
+        if (frames > latency) {
+            latency = frames;
+        }
+    }
+    return latency;
+}
+
+static void ensureLatencies(DeviceSnapshot *snap, DeviceRole role) {
+    AudioObjectPropertyScope scope = roleScope(role);
+    for (UInt32 i = 0; i < snap->count; i++) {
+        DeviceInfo *info = &snap->devices[i];
+        if (!deviceHasRole(info, role) || info->unresponsive
+            || (info->latencyKnown && info->latencyScope == scope)) {
+            continue;
+        }
+        info->hardwareLatency = getDeviceFrames(info->id, kAudioDevicePropertyLatency, scope);
+        info->safetyOffset = getDeviceFrames(info->id, kAudioDevicePropertySafetyOffset, scope);
+        info->bufferFrames = getDeviceFrames(info->id, kAudioDevicePropertyBufferFrameSize,
+                                             kAudioObjectPropertyScopeGlobal);
+        info->streamLatency = getMaxStreamLatency(info->id, scope);
+        info->latencyScope = scope;
+        info->latencyKnown = true;
+    }
+}
+
+static UInt32 totalLatency(const DeviceInfo *info) {
+    return info->hardwareLatency + info->safetyOffset + info->bufferFrames + info->streamLatency;
+}
+
+static double framesToMillis(UInt32 frames, Float64 sampleRate) {
+    return sampleRate > 0 ? frames * 1000.0 / sampleRate : 0;
+}
+
+static void writeLatencyReport(const DeviceSnapshot *snap, DeviceRole role, OutputFormat format, FILE *out) {
+    static const char *const titles[ROLE_COUNT] = {
+        "Output latency", "Input latency", "System output latency"
+    };
+    if (format == FORMAT_TEXT) {
+        fprintf(out, "%-32s %7s %9s   %s\n", titles[role], "frames", "ms", "hardware + safety + buffer + stream");
+    } else if (format == FORMAT_JSON) {
+        fputc('[', out);
+    }
+
+    bool first = true;
+    char sep = format == FORMAT_NUL ? '\0' : '\t';
+    for (UInt32 i = 0; i < snap->count; i++) {
+        const DeviceInfo *info = &snap->devices[i];
+        if (!deviceHasRole(info, role) || info->unresponsive || !info->name) {
+            continue;
+        }
+        UInt32 total = totalLatency(info);
+        double ms = framesToMillis(total, info->sampleRate);
+        bool isDefault = info->id == snap->defaults[role];
+
+        if (format == FORMAT_JSON) {
+            fprintf(out, "%s\n  {\"id\":%u,\"uid\":", first ? "" : ",", (unsigned)info->id);
+            writeJSONString(out, info->uid ? info->uid : "");
+            fputs(",\"name\":", out);
+            writeJSONString(out, info->name);
+            fprintf(out, ",\"transport\":\"%s\",\"sampleRate\":%g,\"hardware\":%u,\"safetyOffset\":%u,"
+                    "\"buffer\":%u,\"stream\":%u,\"frames\":%u,\"ms\":%.3f,\"default\":%s}",
+                    transportTypeName(info->transportType), info->sampleRate,
+                    (unsigned)info->hardwareLatency, (unsigned)info->safetyOffset, (unsigned)info->bufferFrames,
+                    (unsigned)info->streamLatency, (unsigned)total, ms, isDefault ? "true" : "false");
+        } else if (format == FORMAT_TEXT) {
+            fprintf(out, "%c %-30s %7u %9.2f   %u + %u + %u + %u\n", isDefault ? '*' : ' ', info->name,
+                    (unsigned)total, ms, (unsigned)info->hardwareLatency, (unsigned)info->safetyOffset,
+                    (unsigned)info->bufferFrames, (unsigned)info->streamLatency);
+        } else {
+            fprintf(out, "%u%c", (unsigned)info->id, sep);
+            if (format == FORMAT_TSV) {
+                writeTSVField(out, info->uid ? info->uid : "");
+                fputc(sep, out);
+                writeTSVField(out, info->name);
+                fputc(sep, out);
+            } else {
+                fprintf(out, "%s%c%s%c", info->uid ? info->uid : "", sep, info->name, sep);
+            }
+            fprintf(out, "%u%c%.3f%c%u%c%u%c%u%c%u%c", (unsigned)total, sep, ms, sep,
+                    (unsigned)info->hardwareLatency, sep, (unsigned)info->safetyOffset, sep,
+                    (unsigned)info->bufferFrames, sep, (unsigned)info->streamLatency,
+                    format == FORMAT_NUL ? '\0' : '\n');
+        }
+        first = false;
+    }
+
+    if (format == FORMAT_JSON) {
+        fputs(first ? "]\n" : "\n]\n", out);
+    }
+}
+
+static void reportLatencies(DeviceSnapshot *snap, DeviceRole role, OutputFormat format, FILE *out) {
+    ensureSampleRates(snap);
+    ensureLatencies(snap, role);
+
+    char *buf = NULL;
+    size_t len = 0;
+    FILE *mem = open_memstream(&buf, &len);
+    if (!mem) {
+        writeLatencyReport(snap, role, format, out);
+        return;
+    }
+    writeLatencyReport(snap, role, format, mem);
+    fclose(mem);
+    fwrite(buf, 1, len, out);
+    free(buf);
+}
+
+// Picks the device that follows the role's current default in HAL order.
+// Returns NULL when there are fewer than two candidates to rotate between.
+static const DeviceInfo* findNextDevice(const DeviceSnapshot *snap, DeviceRole role, const DeviceInfo **current) {
+    UInt32 candidates = 0;
+    UInt32 currentIndex = 0;
+    *current = NULL;
+
+    for (UInt32 i = 0; i < snap->count; i++) {
+        const DeviceInfo *info = &snap->devices[i];
+        if (deviceHasRole(info, role) && !info->unresponsive) {
+            if (info->id == snap->defaults[role]) {
+                *current = info;
+                currentIndex = i;
+            }
+            candidates++;
+        }
+    }
+
+    if (candidates <= 1) {
+        return NULL;
+    }
+    // Walk on from the current device, wrapping; with no current default the
+    // first candidate wins.
+    UInt32 start = *current ? currentIndex + 1 : 0;
+    for (UInt32 step = 0; step < snap->count; step++) {
+        const DeviceInfo *info = &snap->devices[(start + step) % snap->count];
+        if (deviceHasRole(info, role) && !info->unresponsive) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
+// Picks the member of a resolved rotation set that follows the role's current
+// default, starting with the member switched to last since that is almost
+// always still the default. Outside the set, the first member wins.
+static const DeviceInfo* findNextInCycle(const DeviceSnapshot *snap, RotationCycle *cycle, DeviceRole role,
+                                         const DeviceInfo **current) {
+    AudioDeviceID currentID = snap->defaults[role];
+    UInt32 at = cycle->count;
+    if (cycle->position < cycle->count && snap->devices[cycle->members[cycle->position]].id == currentID) {
+        at = cycle->position;
+    } else {
+        for (UInt32 i = 0; i < cycle->count; i++) {
+            if (snap->devices[cycle->members[i]].id == currentID) {
+                at = i;
+                break;
+            }
+        }
+    }
+
+    *current = NULL;
+    if (at < cycle->count) {
+        *current = &snap->devices[cycle->members[at]];
+    } else {
+        for (UInt32 i = 0; i < snap->count; i++) {
+            if (snap->devices[i].id == currentID) {
+                *current = &snap->devices[i];
+                break;
+            }
+        }
+    }
+
+    UInt32 start = at < cycle->count ? at + 1 : 0;
+    for (UInt32 step = 0; step < cycle->count; step++) {
+        UInt32 member = (start + step) % cycle->count;
+        const DeviceInfo *info = &snap->devices[cycle->members[member]];
+        if (!info->unresponsive && !info->hidden && info != *current) {
+            cycle->position = member;
+            return info;
+        }
+    }
+    return NULL;
+}
+
+static OSStatus setDefaultDevice(DeviceRole role, AudioDeviceID deviceID) {
+    AudioObjectPropertyAddress addr = {
+        .mSelector = roleSelectors[role],
+        .mScope = kAudioObjectPropertyScopeGlobal,
+        .mElement = kAudioObjectPropertyElementMain
+    };
+    UInt32 size = sizeof(deviceID);
+    os_signpost_id_t signpost = traceSignpostID();
+    TRACE_BEGIN(signpost, "set-default", "%s device %u", roleNames[role], (unsigned)deviceID);
+    UInt64 start = mach_absolute_time();
+    OSStatus err = halSetPropertyData(kAudioObjectSystemObject,
+                                      &addr,
+                                      0,
+                                      NULL,
+                                      size,
+                                      &deviceID);
+    recordOperation(METRIC_SET_DEFAULT, deviceID, start);
+    if (err != noErr) {
+        recordSetFailure(deviceID);
+    }
+    TRACE_END(signpost, "set-default");
+    return err;
+}
+
+// ---------------------------------------------------------------------------
+// Switch confirmation
+//
+// AudioObjectSetPropertyData returns before Bluetooth and AirPlay targets have
+// actually taken over. With --wait, listeners on the default-device property
+// and on the target's IsAlive/IsRunningSomewhere are installed before the
+// set, and the command blocks until the HAL reports the target as the live
+// default, or the timeout expires. If audio was playing on the old device we
+// also give the stream a moment to restart on the new one.
+// ---------------------------------------------------------------------------
+
+#define DEFAULT_WAIT_TIMEOUT_MS 2000
+#define RESTART_GRACE_MS 500
+#define WAIT_RECHECK_MS 100
+#define DEFAULT_RETRY_BACKOFF_MS 200
+#define MAX_RETRY_BACKOFF_MS 2000
+#define MAX_RETRIES 100
+
+enum {
+    kSwitchTimedOutError = 'tmot'
+};
+
+typedef struct {
+    DeviceRole role;
+    bool waitForSwitch;
+    long waitTimeoutMs;
+    long retries;           // --retry: extra attempts after a failed set
+    long backoffMs;         // --backoff: first retry interval, doubled each time
+    OutputFormat format;    // for -l
+    const char *rotationSet;    // for -n; NULL rotates through every device
+    const char *aggregateName;  // for --aggregate
+    TransportFilter filter;     // --only / --hide-virtual
+} CommandOptions;
+
+// Run loop that HAL notifications are delivered on, or NULL when they come in
+// on the HAL's own thread (the one-shot CLI).
+static CFRunLoopRef halNotificationRunLoop;
+static bool halNotificationsConfigured;
+
+static void setHALNotificationRunLoop(CFRunLoopRef runLoop) {
+    AudioObjectPropertyAddress addr = {
+        .mSelector = kAudioHardwarePropertyRunLoop,
+        .mScope = kAudioObjectPropertyScopeGlobal,
+        .mElement = kAudioObjectPropertyElementMain
+    };
+    halSetPropertyData(kAudioObjectSystemObject, &addr, 0, NULL, sizeof(runLoop), &runLoop);
+    halNotificationRunLoop = runLoop;
+    halNotificationsConfigured = true;
+}
+
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t cond;
+    bool signaled;
+} SwitchWaiter;
+
+static OSStatus onSwitchProgress(AudioObjectID objectID, UInt32 addressCount,
+                                 const AudioObjectPropertyAddress *addresses, void *clientData) {
+    (void)objectID;
+    (void)addressCount;
+    (void)addresses;
+    SwitchWaiter *waiter = clientData;
+    pthread_mutex_lock(&waiter->lock);
+    waiter->signaled = true;
+    pthread_cond_signal(&waiter->cond);
+    pthread_mutex_unlock(&waiter->lock);
+    return noErr;
+}
+
+// Sleeps until a listener fires or the deadline passes, waking up every
+// WAIT_RECHECK_MS as a safety net against missed notifications. On a run loop
+// thread the notifications are queued behind us, so pump the loop instead.
+// Returns whether a listener fired.
+static bool waitForSwitchProgress(SwitchWaiter *waiter, UInt64 deadline) {
+    UInt64 now = mach_absolute_time();
+    if (now >= deadline) {
+        return false;
+    }
+    if (deadline - now > millisToTicks(WAIT_RECHECK_MS)) {
+        deadline = now + millisToTicks(WAIT_RECHECK_MS);
+    }
+    double remainingUs = ticksToMicros(deadline - now);
+
+    if (halNotificationRunLoop) {
+        CFRunLoopRunInMode(kCFRunLoopDefaultMode, remainingUs / 1e6, true);
+        pthread_mutex_lock(&waiter->lock);
+        bool signaled = waiter->signaled;
+        waiter->signaled = false;
+        pthread_mutex_unlock(&waiter->lock);
+        return signaled;
+    }
+
+    struct timespec until;
+    clock_gettime(CLOCK_REALTIME, &until);
+    long long nanos = (long long)until.tv_nsec + (long long)(remainingUs * 1000.0);
+    until.tv_sec += (time_t)(nanos / 1000000000);
+    until.tv_nsec = (long)(nanos % 1000000000);
+
+    pthread_mutex_lock(&waiter->lock);
+    while (!waiter->signaled
+           && pthread_cond_timedwait(&waiter->cond, &waiter->lock, &until) != ETIMEDOUT) {
+    }
+    bool signaled = waiter->signaled;
+    waiter->signaled = false;
+    pthread_mutex_unlock(&waiter->lock);
+    return signaled;
+}
+
+static bool switchLanded(DeviceRole role, AudioDeviceID target) {
+    UInt32 alive = 1;
+    getUInt32Property(target, kAudioDevicePropertyDeviceIsAlive, kAudioObjectPropertyScopeGlobal, &alive);
+    return alive && getCurrentDefaultDevice(role) == target;
+}
+
+static void addSwitchListeners(DeviceRole role, AudioDeviceID target, SwitchWaiter *waiter, bool add) {
+    AudioObjectPropertyAddress defaultAddr = {
+        roleSelectors[role], kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain
+    };
+    AudioObjectPropertyAddress deviceAddrs[] = {
+        { kAudioDevicePropertyDeviceIsAlive, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioDevicePropertyDeviceIsRunningSomewhere, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+    };
+
+    if (add) {
+        AudioObjectAddPropertyListener(kAudioObjectSystemObject, &defaultAddr, onSwitchProgress, waiter);
+    } else {
+        AudioObjectRemovePropertyListener(kAudioObjectSystemObject, &defaultAddr, onSwitchProgress, waiter);
+    }
+    for (size_t i = 0; i < sizeof(deviceAddrs) / sizeof(deviceAddrs[0]); i++) {
+        if (add) {
+            AudioObjectAddPropertyListener(target, &deviceAddrs[i], onSwitchProgress, waiter);
+        } else {
+            AudioObjectRemovePropertyListener(target, &deviceAddrs[i], onSwitchProgress, waiter);
+        }
+    }
+}
+
+// With --retry, a failed set is tried again as soon as the target's IsAlive
+// (or IsRunningSomewhere, or the default itself) changes, which is when a
+// Bluetooth device that was still connecting becomes settable. The backoff
+// only caps the wait for such an event, doubling from --backoff up to
+// MAX_RETRY_BACKOFF_MS.
+static OSStatus setDefaultDeviceWithRetry(DeviceRole role, AudioDeviceID target, const CommandOptions *options,
+                                          SwitchWaiter *waiter) {
+    OSStatus err = setDefaultDevice(role, target);
+    long backoffMs = options->backoffMs;
+    for (long attempt = 0; err != noErr && attempt < options->retries; attempt++) {
+        UInt64 deadline = mach_absolute_time() + millisToTicks(backoffMs);
+        while (!waitForSwitchProgress(waiter, deadline) && mach_absolute_time() < deadline) {
+        }
+        backoffMs = backoffMs * 2 < MAX_RETRY_BACKOFF_MS ? backoffMs * 2 : MAX_RETRY_BACKOFF_MS;
+        err = setDefaultDevice(role, target);
+    }
+    return err;
+}
+
+// Sets the role's default and, with --wait, blocks until it has landed.
+// On success *confirmMs holds how long confirmation took, or -1 without --wait.
+static OSStatus switchDefaultDevice(DeviceRole role, AudioDeviceID target, const CommandOptions *options,
+                                    double *confirmMs) {
+    *confirmMs = -1;
+    if (!options->waitForSwitch && options->retries == 0) {
+        return setDefaultDevice(role, target);
+    }
+
+    if (!halNotificationsConfigured) {
+        setHALNotificationRunLoop(NULL);
+    }
+
+    SwitchWaiter waiter = { .signaled = false };
+    pthread_mutex_init(&waiter.lock, NULL);
+    pthread_cond_init(&waiter.cond, NULL);
+    addSwitchListeners(role, target, &waiter, true);
+
+    UInt32 wasRunning = 0;
+    AudioDeviceID previous = getCurrentDefaultDevice(role);
+    if (previous != kAudioObjectUnknown && previous != target) {
+        getUInt32Property(previous, kAudioDevicePropertyDeviceIsRunningSomewhere,
+                          kAudioObjectPropertyScopeGlobal, &wasRunning);
+    }
+
+    OSStatus err = setDefaultDeviceWithRetry(role, target, options, &waiter);
+    if (err == noErr && options->waitForSwitch) {
+        // The timeout counts from the set that succeeded, not from the first attempt.
+        UInt64 start = mach_absolute_time();
+        UInt64 deadline = start + millisToTicks(options->waitTimeoutMs);
+        while (!switchLanded(role, target) && mach_absolute_time() < deadline) {
+            waitForSwitchProgress(&waiter, deadline);
+        }
+
+        recordOperation(METRIC_CONFIRM, target, start);
+        if (!switchLanded(role, target)) {
+            err = kSwitchTimedOutError;
+        } else if (wasRunning) {
+            // Best effort: the switch itself has landed, so running out of
+            // grace here is not a failure.
+            UInt64 grace = mach_absolute_time() + millisToTicks(RESTART_GRACE_MS);
+            if (grace > deadline) {
+                grace = deadline;
+            }
+            UInt32 running = 0;
+            while (getUInt32Property(target, kAudioDevicePropertyDeviceIsRunningSomewhere,
+                                     kAudioObjectPropertyScopeGlobal, &running)
+                   && !running && mach_absolute_time() < grace) {
+                waitForSwitchProgress(&waiter, grace);
+            }
+        }
+        *confirmMs = ticksToMicros(mach_absolute_time() - start) / 1000.0;
+    }
+
+    addSwitchListeners(role, target, &waiter, false);
+    pthread_cond_destroy(&waiter.cond);
+    pthread_mutex_destroy(&waiter.lock);
+    return err;
+}
+
+static void printSwitchError(OSStatus err, DeviceRole role, const DeviceInfo *target,
+                             const CommandOptions *options, FILE *out) {
+    if (err == kSwitchTimedOutError) {
+        fprintf(out, "Timed out after %ld ms waiting for \"%s\" to become the default %s\n",
+                options->waitTimeoutMs, target->name ?: "Unknown", roleNames[role]);
+    } else {
+        fprintf(out, "Failed to set default %s device: %d\n", roleNames[role], (int)err);
+    }
+}
+
+static void printConfirmation(double confirmMs, FILE *out) {
+    if (confirmMs >= 0) {
+        fprintf(out, "Confirmed after %.1f ms.\n", confirmMs);
+    }
+}
+
+static RotationCycle* resolveRotationCycle(DeviceSnapshot *snap, DeviceRole role, const char *setName, FILE *err);
+
+static int switchToNextDevice(DeviceSnapshot *snap, const CommandOptions *options, FILE *out, FILE *err) {
+    const DeviceInfo *current;
+    const DeviceInfo *next;
+    UInt64 start = mach_absolute_time();
+    if (options->rotationSet) {
+        RotationCycle *cycle = resolveRotationCycle(snap, options->role, options->rotationSet, err);
+        if (!cycle) {
+            return 1;
+        }
+        next = findNextInCycle(snap, cycle, options->role, &current);
+    } else {
+        next = findNextDevice(snap, options->role, &current);
+    }
+    recordOperation(METRIC_RESOLVE, next ? next->id : kAudioObjectUnknown, start);
+
+    if (!next) {
+        fprintf(out, "Only one or no %s devices available. Cannot switch.\n", roleNames[options->role]);
+        return 0;
+    }
+
+    const char *currentName = current ? current->name : NULL;
+
+    double confirmMs;
+    OSStatus status = switchDefaultDevice(options->role, next->id, options, &confirmMs);
+    if (status == noErr) {
+        snap->defaults[options->role] = next->id;
+        fprintf(out, "Switched from \"%s\" to \"%s\"\n",
+                currentName ?: "Unknown", next->name ?: "Unknown");
+        printConfirmation(confirmMs, out);
+        return 0;
+    }
+    printSwitchError(status, options->role, next, options, err);
+    return 1;
+}
+
+// ---------------------------------------------------------------------------
+// Config tables
+//
+// Names collide and device IDs change across reboots, but UIDs are stable.
+// The files under ~/.config/switch_audio/ map short names to UIDs, one
+// "name = value" per line, '#' starting a comment: "aliases" gives a single
+// UID per name, "sets" a comma-separated rotation list. Each
+// file is mapped and parsed once into a hash table keyed like device names
+// (case and whitespace folded); it is re-read only when its size or mtime
+// changes, so a running daemon picks up edits without paying for them per
+// request.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char *name;         // as written in the file
+    char *matchName;
+    char *value;
+    UInt32 hash;
+} ConfigEntry;
+
+typedef struct {
+    const char *envName;        // path override
+    const char *fileName;       // under the config directory
+    const char *valueLabel;     // for parse warnings
+    bool quoted;                // values are split like a command line
+    ConfigEntry *entries;
+    UInt32 count;
+    DeviceIndex index;
+    Arena arena;
+    bool checked;
+    UInt32 generation;          // bumped on every reload
+    time_t mtime;
+    off_t size;
+} ConfigTable;
+
+static ConfigTable aliasTable = { .envName = "SWITCH_AUDIO_ALIASES", .fileName = "aliases", .valueLabel = "UID" };
+static ConfigTable setTable = { .envName = "SWITCH_AUDIO_SETS", .fileName = "sets", .valueLabel = "UID, UID, ..." };
+
+static bool getConfigPath(const ConfigTable *table, char *path, size_t size) {
+    const char *override = getenv(table->envName);
+    if (override && *override) {
+        return (size_t)snprintf(path, size, "%s", override) < size;
+    }
+    const char *config = getenv("XDG_CONFIG_HOME");
+    if (config && *config) {
+        return (size_t)snprintf(path, size, "%s/switch_audio/%s", config, table->fileName) < size;
+    }
+    const char *home = getenv("HOME");
+    if (!home || !*home) {
+        return false;
+    }
+    return (size_t)snprintf(path, size, "%s/.config/switch_audio/%s", home, table->fileName) < size;
+}
+
+static void trimSpan(const char **start, const char **end) {
+    while (*start < *end && (**start == ' ' || **start == '\t')) {
+        (*start)++;
+    }
+    while (*end > *start && ((*end)[-1] == ' ' || (*end)[-1] == '\t' || (*end)[-1] == '\r')) {
+        (*end)--;
+    }
+}
+
+// In a quoted table, quotes and escapes follow splitCommandLine, so a quoted
+// or escaped '#' in a scene's UID or a hotkey's device name is kept. Aliases
+// and sets take their values literally, so any '#' starts a comment there.
+static const char* findConfigComment(const char *line, const char *end, bool quoted) {
+    if (!quoted) {
+        return memchr(line, '#', (size_t)(end - line));
+    }
+    char quote = '\0';
+    for (const char *p = line; p < end; p++) {
+        if (*p == '\\' && quote != '\'' && p + 1 < end) {
+            p++;
+        } else if (quote) {
+            quote = *p == quote ? '\0' : quote;
+        } else if (*p == '\'' || *p == '"') {
+            quote = *p;
+        } else if (*p == '#') {
+            return p;
+        }
+    }
+    return NULL;
+}
+
+static char* arenaStrndup(Arena *arena, const char *str, size_t len) {
+    char *copy = arenaAlloc(arena, len + 1);
+    if (copy) {
+        memcpy(copy, str, len);
+        copy[len] = '\0';
+    }
+    return copy;
+}
+
+static void parseConfigTable(ConfigTable *table, const char *path, const char *text, size_t len) {
+    UInt32 lines = 1;
+    for (size_t i = 0; i < len; i++) {
+        lines += text[i] == '\n';
+    }
+    table->entries = arenaCalloc(&table->arena, lines, sizeof(ConfigEntry));
+    if (!table->entries || !initDeviceIndex(&table->arena, &table->index, lines)) {
+        return;
+    }
+
+    const char *end = text + len;
+    UInt32 lineNumber = 0;
+    for (const char *line = text; line < end; ) {
+        const char *lineEnd = memchr(line, '\n', (size_t)(end - line));
+        if (!lineEnd) {
+            lineEnd = end;
+        }
+        const char *next = lineEnd < end ? lineEnd + 1 : end;
+        lineNumber++;
+
+        const char *comment = findConfigComment(line, lineEnd, table->quoted);
+        if (comment) {
+            lineEnd = comment;
+        }
+        trimSpan(&line, &lineEnd);
+        if (line == lineEnd) {
+            line = next;
+            continue;
+        }
+
+        const char *eq = memchr(line, '=', (size_t)(lineEnd - line));
+        const char *nameEnd = eq, *value = eq ? eq + 1 : NULL, *valueEnd = lineEnd;
+        if (eq) {
+            trimSpan(&line, &nameEnd);
+            trimSpan(&value, &valueEnd);
+        }
+        if (!eq || line == nameEnd || value == valueEnd) {
+            fprintf(stderr, "%s:%u: expected NAME = %s\n", path, (unsigned)lineNumber, table->valueLabel);
+            line = next;
+            continue;
+        }
+
+        ConfigEntry *entry = &table->entries[table->count];
+        char *name = arenaStrndup(&table->arena, line, (size_t)(nameEnd - line));
+        entry->value = arenaStrndup(&table->arena, value, (size_t)(valueEnd - value));
+        entry->matchName = name ? arenaAlloc(&table->arena, strlen(name) + 1) : NULL;
+        if (!entry->value || !entry->matchName) {
+            return;
+        }
+        entry->name = name;
+        normalizeNameInto(name, entry->matchName);
+        entry->hash = hashString(entry->matchName);
+        indexInsert(&table->index, entry->hash, table->count);
+        table->count++;
+        line = next;
+    }
+}
+
+// Loads the table on first use and reloads it when the file changes. A
+// missing file simply means an empty table.
+static void refreshConfigTable(ConfigTable *table) {
+    char path[1024];
+    struct stat st;
+    bool exists = getConfigPath(table, path, sizeof(path)) && stat(path, &st) == 0 && S_ISREG(st.st_mode);
+    if (table->checked && (exists ? table->mtime == st.st_mtime && table->size == st.st_size
+                                  : table->count == 0)) {
+        return;
+    }
+
+    freeArena(&table->arena);
+    table->entries = NULL;
+    table->count = 0;
+    table->index = (DeviceIndex){ 0 };
+    table->mtime = 0;
+    table->size = 0;
+    table->checked = true;
+    table->generation++;
+    if (!exists) {
+        return;
+    }
+    table->mtime = st.st_mtime;
+    table->size = st.st_size;
+    if (st.st_size == 0) {
+        return;
+    }
+
+    int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return;
+    }
+    size_t mapSize = (size_t)st.st_size;
+    void *map = mmap(NULL, mapSize, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED) {
+        return;
+    }
+    parseConfigTable(table, path, map, mapSize);
+    munmap(map, mapSize);
+}
+
+// Stamps the file as refreshConfigTable() would see it, without reading it.
+static ConfigStamp stampConfigFile(const ConfigTable *table) {
+    char path[1024];
+    struct stat st;
+    if (!getConfigPath(table, path, sizeof(path)) || stat(path, &st) != 0 || !S_ISREG(st.st_mode)) {
+        return (ConfigStamp){ 0 };
+    }
+    return (ConfigStamp){ .mtime = st.st_mtime, .size = st.st_size };
+}
+
+static bool sameConfigStamp(ConfigStamp a, ConfigStamp b) {
+    return a.mtime == b.mtime && a.size == b.size;
+}
+
+// Returns the value stored for name, or NULL when the table has no entry.
+// The pointer stays valid until the table is next refreshed.
+static const char* lookupConfigEntry(ConfigTable *table, const char *name) {
+    refreshConfigTable(table);
+    if (!table->count) {
+        return NULL;
+    }
+
+    char keyBuf[256];
+    char *key = normalizeName(name, keyBuf, sizeof(keyBuf));
+    if (!key) {
+        return NULL;
+    }
+    UInt32 hash = hashString(key);
+    const char *value = NULL;
+    for (UInt32 slot = hash & table->index.mask; table->index.slots[slot];
+         slot = (slot + 1) & table->index.mask) {
+        const ConfigEntry *entry = &table->entries[table->index.slots[slot] - 1];
+        if (entry->hash == hash && strcmp(entry->matchName, key) == 0) {
+            value = entry->value;
+            break;
+        }
+    }
+    if (key != keyBuf) {
+        free(key);
+    }
+    return value;
+}
+
+// Returns the UID an alias stands for, or NULL when name is not an alias.
+static const char* lookupAlias(const char *name) {
+    return lookupConfigEntry(&aliasTable, name);
+}
+
+// ---------------------------------------------------------------------------
+// Name matching
+//
+// Turns what the user typed into a snapshot entry for the requested role.
+// ---------------------------------------------------------------------------
+
+// True when every word of the normalized query is a prefix of the
+// corresponding word of the normalized name, so "ext head" matches
+// "external headphones".
+static bool wordPrefixMatch(const char *name, const char *query) {
+    while (*query) {
+        while (*query && *query != ' ') {
+            if (*name != *query) {
+                return false;
+            }
+            name++;
+            query++;
+        }
+        if (*query == ' ') {
+            query++;
+            name = strchr(name, ' ');
+            if (!name) {
+                return false;
+            }
+            name++;
+        }
+    }
+    return true;
+}
+
+typedef enum {
+    MATCH_NONE,
+    MATCH_FOUND,
+    MATCH_AMBIGUOUS
+} MatchResult;
+
+static const DeviceInfo* findDeviceByUID(const DeviceSnapshot *snap, DeviceRole role, const char *uid) {
+    UInt32 uidHash = hashString(uid);
+    for (UInt32 slot = uidHash & snap->byUID.mask; snap->byUID.slots[slot];
+         slot = (slot + 1) & snap->byUID.mask) {
+        const DeviceInfo *info = &snap->devices[snap->byUID.slots[slot] - 1];
+        if (deviceHasRole(info, role) && info->uidHash == uidHash && strcmp(info->uid, uid) == 0) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
+// Resolves a user-supplied device reference. Tried in order: alias, exact
+// name, UID, case-insensitive name, then unique word prefix. All but the last
+// go straight through hash tables; only the prefix pass visits every device,
+// and it compares the precomputed normalized names without converting
+// anything. An alias whose device is absent resolves to nothing rather than
+// falling back to names, so it can never pick a different device.
+static const DeviceInfo* findSnapshotDevice(const DeviceSnapshot *snap, AudioDeviceID deviceID) {
+    for (UInt32 i = 0; i < snap->count; i++) {
+        if (snap->devices[i].id == deviceID) {
+            return &snap->devices[i];
+        }
+    }
+    return NULL;
+}
+
+static MatchResult findDeviceByName(const DeviceSnapshot *snap, DeviceRole role, const char* wantedName,
+                                    const DeviceInfo **found) {
+    *found = NULL;
+    const char *aliasUID = lookupAlias(wantedName);
+    if (aliasUID) {
+        *found = findDeviceByUID(snap, role, aliasUID);
+        return *found ? MATCH_FOUND : MATCH_NONE;
+    }
+
+    char queryBuf[256];
+    char *query = normalizeName(wantedName, queryBuf, sizeof(queryBuf));
+    if (!query || !snap->count) {
+        if (query != queryBuf) {
+            free(query);
+        }
+        return MATCH_NONE;
+    }
+
+    UInt32 queryHash = hashString(query);
+    const DeviceInfo *foldedMatch = NULL;
+    int foldedCount = 0;
+
+    for (UInt32 slot = queryHash & snap->byName.mask; snap->byName.slots[slot];
+         slot = (slot + 1) & snap->byName.mask) {
+        const DeviceInfo *info = &snap->devices[snap->byName.slots[slot] - 1];
+        if (!deviceHasRole(info, role) || info->nameHash != queryHash || strcmp(info->matchName, query) != 0) {
+            continue;
+        }
+        // Probing can visit duplicates out of HAL order; keep the first one.
+        if (strcmp(info->name, wantedName) == 0 && (!*found || info < *found)) {
+            *found = info;
+        }
+        if (!foldedMatch || info < foldedMatch) {
+            foldedMatch = info;
+        }
+        foldedCount++;
+    }
+
+    if (!*found) {
+        *found = findDeviceByUID(snap, role, wantedName);
+    }
+
+    MatchResult result = MATCH_FOUND;
+    if (!*found && foldedCount == 1) {
+        *found = foldedMatch;
+    } else if (!*found && foldedCount > 1) {
+        result = MATCH_AMBIGUOUS;
+    } else if (!*found) {
+        int prefixCount = 0;
+        for (UInt32 i = 0; i < snap->count; i++) {
+            const DeviceInfo *info = &snap->devices[i];
+            if (deviceHasRole(info, role) && info->matchName && wordPrefixMatch(info->matchName, query)) {
+                *found = info;
+                prefixCount++;
+            }
+        }
+        if (prefixCount > 1) {
+            *found = NULL;
+            result = MATCH_AMBIGUOUS;
+        } else if (prefixCount == 0) {
+            result = MATCH_NONE;
+        }
+    }
+
+    if (query != queryBuf) {
+        free(query);
+    }
+    return result;
+}
+
+static void printNameCandidates(const DeviceSnapshot *snap, DeviceRole role, const char *wantedName, FILE *out) {
+    char queryBuf[256];
+    char *query = normalizeName(wantedName, queryBuf, sizeof(queryBuf));
+    if (!query) {
+        return;
+    }
+    for (UInt32 i = 0; i < snap->count; i++) {
+        const DeviceInfo *info = &snap->devices[i];
+        if (deviceHasRole(info, role) && info->matchName && wordPrefixMatch(info->matchName, query)) {
+            fprintf(out, "  %s\n", info->name);
+        }
+    }
+    if (query != queryBuf) {
+        free(query);
+    }
+}
+
+// ---------------------------------------------------------------------------
+// Shell completion
+//
+// --complete [-t TYPE] [PREFIX] prints every device name the role can take
+// that PREFIX would resolve to as a unique word prefix, then every matching
+// alias of a connected device, one raw name per line. It runs on each Tab
+// press, so it reads only the device cache and the alias file and never
+// initializes CoreAudio. Names can therefore be one hotplug behind; without
+// a cache (before the first ordinary run) nothing is completed.
+// ---------------------------------------------------------------------------
+
+static bool completionMatches(const char *name, const char *query) {
+    char normBuf[256];
+    char *norm = normalizeName(name, normBuf, sizeof(normBuf));
+    bool matched = norm && wordPrefixMatch(norm, query);
+    if (norm != normBuf) {
+        free(norm);
+    }
+    return matched;
+}
+
+static void writeCompletions(const CacheHeader *header, DeviceRole role, const char *query, FILE *out) {
+    const CacheRecord *records = (const CacheRecord *)(header + 1);
+    const char *pool = cachedStringPool(header);
+    for (UInt32 i = 0; i < header->count; i++) {
+        const char *name = cachedString(pool, header->stringBytes, records[i].nameOffset);
+        bool hasRole = role == ROLE_INPUT ? records[i].hasInput : records[i].hasOutput;
+        if (!name || !hasRole || !completionMatches(name, query)) {
+            continue;
+        }
+        bool seen = false;
+        for (UInt32 j = 0; j < i && !seen; j++) {
+            const char *other = cachedString(pool, header->stringBytes, records[j].nameOffset);
+            seen = other && (role == ROLE_INPUT ? records[j].hasInput : records[j].hasOutput)
+                && strcmp(other, name) == 0;
+        }
+        if (!seen) {
+            fprintf(out, "%s\n", name);
+        }
+    }
+
+    refreshConfigTable(&aliasTable);
+    for (UInt32 i = 0; i < aliasTable.count; i++) {
+        const ConfigEntry *entry = &aliasTable.entries[i];
+        if (!wordPrefixMatch(entry->matchName, query)) {
+            continue;
+        }
+        for (UInt32 j = 0; j < header->count; j++) {
+            const char *uid = cachedString(pool, header->stringBytes, records[j].uidOffset);
+            bool hasRole = role == ROLE_INPUT ? records[j].hasInput : records[j].hasOutput;
+            if (hasRole && uid && strcmp(uid, entry->value) == 0) {
+                fprintf(out, "%s\n", entry->name);
+                break;
+            }
+        }
+    }
+}
+
+static int runComplete(int argc, char* argv[]) {
+    DeviceRole role = ROLE_OUTPUT;
+    const char *prefix = "";
+    bool havePrefix = false, endOfOptions = false;
+    for (int i = 2; i < argc; i++) {
+        if (!endOfOptions && (strcmp(argv[i], "-t") == 0 || strcmp(argv[i], "--type") == 0)) {
+            if (i + 1 >= argc || !parseDeviceRole(argv[i + 1], &role)) {
+                fprintf(stderr, "Error: -t must be output, input or system.\n");
+                return 1;
+            }
+            i++;
+        } else if (!endOfOptions && strcmp(argv[i], "--") == 0) {
+            endOfOptions = true;
+        } else if (!havePrefix) {
+            prefix = argv[i];
+            havePrefix = true;
+        } else {
+            fprintf(stderr, "Error: --complete takes at most one prefix.\n");
+            return 1;
+        }
+    }
+
+    char queryBuf[256];
+    char *query = normalizeName(prefix, queryBuf, sizeof(queryBuf));
+    size_t mapSize;
+    const CacheHeader *header = query ? mapCacheFile(&mapSize) : NULL;
+    if (header) {
+        writeCompletions(header, role, query, stdout);
+        munmap((void *)header, mapSize);
+    }
+    if (query != queryBuf) {
+        free(query);
+    }
+    return 0;
+}
+
+static void printUsage(const char* progName, FILE *out) {
+    fprintf(out, "Usage: %s [OPTIONS] [DEVICE_NAME] ...\n", progName);
+    fprintf(out, "       %s --batch [FILE]\n\n", progName);
+    fprintf(out, "Switch macOS default audio output device\n\n");
+    fprintf(out, "Options:\n");
+    fprintf(out, "  -l, --list    List available audio output devices\n");
+    fprintf(out, "  --format FMT  List as text, json, tsv or nul (ID, UID, name, transport,\n");
+    fprintf(out, "                channels, sample rate, default)\n");
+    fprintf(out, "  --latency     Show each device's effective latency in frames and ms\n");
+    fprintf(out, "                (hardware + safety offset + buffer + stream; honours --format)\n");
+    fprintf(out, "  -n, --next    Switch to next available device\n");
+    fprintf(out, "  --only LIST   Consider only devices on these transports, e.g. builtin,usb,\n");
+    fprintf(out, "                bluetooth,hdmi (also virtual, aggregate, pci, thunderbolt, ...)\n");
+    fprintf(out, "  --hide-virtual  Ignore virtual (loopback) and aggregate devices\n");
+    fprintf(out, "  --set NAME    Make -n cycle through the devices of rotation set NAME only\n");
+    fprintf(out, "  -t TYPE       Following actions act on the output (default), input or\n");
+    fprintf(out, "                system (alert) device\n");
+    fprintf(out, "  --uid UID     Switch to the device with this UID (or alias) without enumerating\n");
+    fprintf(out, "  --all NAME    Make NAME the default output, input and system device at once,\n");
+    fprintf(out, "                restoring the previous defaults if any step fails\n");
+    fprintf(out, "  --volume N    Set the default (or just-switched) device's volume to N%%,\n");
+    fprintf(out, "                or step it with +N / -N\n");
+    fprintf(out, "  --mute, --unmute  Mute or unmute the default (or just-switched) device\n");
+    fprintf(out, "  --rate HZ     Set the default (or just-switched) device's sample rate\n");
+    fprintf(out, "  --buffer N    Set its I/O buffer size to N frames\n");
+    fprintf(out, "  --aggregate LIST  Create a multi-output device from \"A,B,...\" (named with\n");
+    fprintf(out, "                --name NAME) and make it the default output\n");
+    fprintf(out, "  --teardown NAME   Remove an aggregate device created with --aggregate\n");
+    fprintf(out, "  --scene NAME  Apply a saved scene: default devices, volumes, rates and buffers\n");
+    fprintf(out, "  --save-scene NAME  Save the current defaults and their settings as a scene\n");
+    fprintf(out, "  -h, --help    Show this help message\n");
+    fprintf(out, "  --version     Print the version and exit\n");
+    fprintf(out, "  --complete [-t TYPE] [PREFIX]  Print the device names and aliases PREFIX\n");
+    fprintf(out, "                could resolve to, for shell completion (reads only the device\n");
+    fprintf(out, "                cache, never the HAL)\n");
+    fprintf(out, "  -w, --wait    Block until a switch has actually landed\n");
+    fprintf(out, "  --timeout MS  Give up waiting after MS milliseconds (default %d; implies --wait)\n",
+            DEFAULT_WAIT_TIMEOUT_MS);
+    fprintf(out, "  --retry N     Retry a failed switch up to N times, as soon as the device's\n");
+    fprintf(out, "                IsAlive state changes or after the backoff at the latest\n");
+    fprintf(out, "  --backoff MS  Longest first wait between retries (default %d, doubling)\n",
+            DEFAULT_RETRY_BACKOFF_MS);
+    fprintf(out, "  --batch FILE  Run one command line per line of FILE (or stdin)\n");
+    fprintf(out, "  --bench N     Time every command path N times and report min/median/p99\n");
+    fprintf(out, "  --watch       Print default-device and hotplug events as they happen\n");
+    fprintf(out, "                (--format json for one JSON object per line)\n");
+    fprintf(out, "  --daemon      Keep a cached device snapshot and serve requests on a local socket\n");
+    fprintf(out, "  --stats       Print the daemon's switch counts, latency histograms and device\n");
+    fprintf(out, "                connects/disconnects in Prometheus text format\n");
+    fprintf(out, "  --prefer LIST With --watch or --daemon, switch to the first available device\n");
+    fprintf(out, "                in \"A > B > C\" whenever devices appear or disappear\n");
+    fprintf(out, "  --hotkey \"KEYS = COMMAND\"  With --daemon, run COMMAND (e.g. -n, -n --set desk,\n");
+    fprintf(out, "                or a device name) in-process when KEYS (e.g. ctrl+opt+n) is pressed;\n");
+    fprintf(out, "                also read from ~/.config/switch_audio/hotkeys\n");
+    fprintf(out, "  --trace       Log every HAL call with timings to stderr (or SWITCH_AUDIO_TRACE=1)\n\n");
+    fprintf(out, "Several actions may be chained; they run in order against one device snapshot.\n");
+    fprintf(out, "When a daemon is running, commands are forwarded to it automatically.\n");
+    fprintf(out, "Set SWITCH_AUDIO_NO_DAEMON=1 to always query the HAL directly, and\n");
+    fprintf(out, "SWITCH_AUDIO_NO_CACHE=1 to ignore the on-disk device cache. Devices that take\n");
+    fprintf(out, "longer than SWITCH_AUDIO_PROBE_TIMEOUT_MS (default %d) to answer are skipped.\n\n",
+            DEFAULT_PROBE_TIMEOUT_MS);
+    fprintf(out, "DEVICE_NAME may be an alias, an exact name, a device UID, a case-insensitive\n");
+    fprintf(out, "name, or an unambiguous prefix of each word of the name, or a fallback chain\n");
+    fprintf(out, "\"A || B || C\" that switches to the first one that works. Aliases are read from\n");
+    fprintf(out, "~/.config/switch_audio/aliases (or SWITCH_AUDIO_ALIASES), one \"name = UID\" per line;\n");
+    fprintf(out, "rotation sets from ~/.config/switch_audio/sets (or SWITCH_AUDIO_SETS), one\n");
+    fprintf(out, "\"name = UID, UID, ...\" per line.\n\n");
+    fprintf(out, "Examples:\n");
+    fprintf(out, "  %s -l                          # List available devices\n", progName);
+    fprintf(out, "  %s \"External Headphones\"      # Switch to headphones\n", progName);
+    fprintf(out, "  %s \"ext head\"                 # Same, by word prefix\n", progName);
+    fprintf(out, "  %s -n -l                       # Switch to next, then list\n", progName);
+    fprintf(out, "  %s -n --set desk               # Next device of the \"desk\" set\n", progName);
+    fprintf(out, "  %s scar -t input scar          # Speakers and mic, one enumeration\n", progName);
+    fprintf(out, "  %s Speakers --volume 30        # Switch, then set the volume\n", progName);
+}
+
+// Resolves a name for a role and explains any failure on err.
+static const DeviceInfo* resolveNamedDevice(const DeviceSnapshot *snap, DeviceRole role, const char *deviceName,
+                                            const char *progName, FILE *err) {
+    const DeviceInfo *dev;
+    UInt64 start = mach_absolute_time();
+    MatchResult match = findDeviceByName(snap, role, deviceName, &dev);
+    recordOperation(METRIC_RESOLVE, dev ? dev->id : kAudioObjectUnknown, start);
+    if (match == MATCH_AMBIGUOUS) {
+        fprintf(err, "Device \"%s\" matches more than one device:\n", deviceName);
+        printNameCandidates(snap, role, deviceName, err);
+        return NULL;
+    }
+    if (match == MATCH_NONE) {
+        const char *aliasUID = lookupAlias(deviceName);
+        if (aliasUID) {
+            fprintf(err, "Alias \"%s\" refers to %s, which is not connected.\n", deviceName, aliasUID);
+            return NULL;
+        }
+        fprintf(err, "Device \"%s\" not found.\n", deviceName);
+        fprintf(err, "Use '%s -l' to list available devices.\n", progName);
+        return NULL;
+    }
+    return dev;
+}
+
+// "AirPods || Speakers": tries each alternative in order, skipping ones that
+// are not connected, not responding or fail to switch (after --retry), and
+// stops at the first that works. Why each was skipped is only reported when
+// none of them does.
+static int switchToFallbackChain(DeviceSnapshot *snap, const char *chain, const char *progName,
+                                 const CommandOptions *options, FILE *out, FILE *err) {
+    char *notesBuf = NULL;
+    size_t notesLen = 0;
+    FILE *notes = open_memstream(&notesBuf, &notesLen);
+    char *copy = strdup(chain);
+    if (!notes || !copy) {
+        if (notes) {
+            fclose(notes);
+        }
+        free(notesBuf);
+        free(copy);
+        return 1;
+    }
+
+    const DeviceInfo *switched = NULL;
+    double confirmMs = -1;
+    for (char *cursor = copy; cursor && !switched; ) {
+        char *sep = strstr(cursor, "||");
+        if (sep) {
+            *sep = '\0';
+        }
+        const char *name = cursor, *nameEnd = cursor + strlen(cursor);
+        cursor = sep ? sep + 2 : NULL;
+        trimSpan(&name, &nameEnd);
+        if (nameEnd - name >= 2 && (*name == '"' || *name == '\'') && nameEnd[-1] == *name) {
+            name++;
+            nameEnd--;
+        }
+        if (name == nameEnd) {
+            continue;
+        }
+        *(char *)nameEnd = '\0';
+
+        const DeviceInfo *dev = resolveNamedDevice(snap, options->role, name, progName, notes);
+        if (!dev) {
+            continue;
+        }
+        if (dev->unresponsive) {
+            fprintf(notes, "Device \"%s\" is not responding.\n", dev->name);
+            continue;
+        }
+        OSStatus status = switchDefaultDevice(options->role, dev->id, options, &confirmMs);
+        if (status != noErr) {
+            printSwitchError(status, options->role, dev, options, notes);
+            continue;
+        }
+        switched = dev;
+    }
+    fclose(notes);
+
+    int result = 0;
+    if (switched) {
+        snap->defaults[options->role] = switched->id;
+        fprintf(out, "Switched default %s to \"%s\".\n", roleNames[options->role], switched->name);
+        printConfirmation(confirmMs, out);
+    } else {
+        fprintf(err, "No device in \"%s\" could be made the default %s:\n", chain, roleNames[options->role]);
+        if (notesBuf) {
+            fwrite(notesBuf, 1, notesLen, err);
+        }
+        result = 1;
+    }
+    free(notesBuf);
+    free(copy);
+    return result;
+}
+
+static int switchToNamedDevice(DeviceSnapshot *snap, const char *deviceName, const char *progName,
+                               const CommandOptions *options, FILE *out, FILE *err) {
+    if (strstr(deviceName, "||")) {
+        return switchToFallbackChain(snap, deviceName, progName, options, out, err);
+    }
+    const DeviceInfo *dev = resolveNamedDevice(snap, options->role, deviceName, progName, err);
+    if (!dev) {
+        return 1;
+    }
+
+    double confirmMs;
+    OSStatus status = switchDefaultDevice(options->role, dev->id, options, &confirmMs);
+    if (status != noErr) {
+        printSwitchError(status, options->role, dev, options, err);
+        return 1;
+    }
+
+    snap->defaults[options->role] = dev->id;
+    fprintf(out, "Switched default %s to \"%s\".\n", roleNames[options->role], dev->name);
+    printConfirmation(confirmMs, out);
+    return 0;
+}
+
+// --uid switches without a snapshot when none is at hand: the UID (or the
+// alias for one) is translated straight to a device ID, and one stream-layout
+// read confirms the device can take the role. The cost stays flat however
+// many devices are installed. With a snapshot (daemon, batch, chained
+// actions) its UID index answers instead, without touching the HAL.
+static int switchByUID(DeviceSnapshot *snap, const char *arg, const CommandOptions *options,
+                       FILE *out, FILE *err) {
+    DeviceRole role = options->role;
+    const char *aliasUID = lookupAlias(arg);
+    const char *uid = aliasUID ? aliasUID : arg;
+
+    AudioDeviceID deviceID;
+    char *fetchedName = NULL;
+    const char *name;
+    UInt64 start = mach_absolute_time();
+    if (snap) {
+        const DeviceInfo *dev = findDeviceByUID(snap, role, uid);
+        deviceID = dev && !dev->unresponsive ? dev->id : kAudioObjectUnknown;
+        name = dev ? dev->name : NULL;
+    } else {
+        deviceID = translateUIDToDevice(uid);
+        UInt32 channels;
+        if (deviceID != kAudioObjectUnknown && !deviceSupportsScope(deviceID, roleScope(role), &channels)) {
+            deviceID = kAudioObjectUnknown;
+        }
+        name = NULL;
+    }
+    recordOperation(METRIC_RESOLVE, deviceID, start);
+    if (deviceID == kAudioObjectUnknown) {
+        fprintf(err, "No connected %s device has UID \"%s\".\n", roleNames[role], uid);
+        return 1;
+    }
+
+    double confirmMs;
+    OSStatus status = switchDefaultDevice(role, deviceID, options, &confirmMs);
+    if (!name) {
+        name = fetchedName = getDeviceName(deviceID);
+    }
+    if (status != noErr) {
+        DeviceInfo target = { .id = deviceID, .name = (char *)name };
+        printSwitchError(status, role, &target, options, err);
+        free(fetchedName);
+        return 1;
+    }
+
+    if (snap) {
+        snap->defaults[role] = deviceID;
+    }
+    fprintf(out, "Switched default %s to \"%s\".\n", roleNames[role], name ?: uid);
+    printConfirmation(confirmMs, out);
+    free(fetchedName);
+    return 0;
+}
+
+// "output", "input and output", "output, input and system".
+static void joinRoleNames(const DeviceRole *roles, int count, char *buf, size_t size) {
+    size_t len = 0;
+    buf[0] = '\0';
+    for (int i = 0; i < count && len < size; i++) {
+        const char *sep = i == 0 ? "" : i == count - 1 ? " and " : ", ";
+        len += (size_t)snprintf(buf + len, size - len, "%s%s", sep, roleNames[roles[i]]);
+    }
+}
+
+// Makes one device the default for every role it can take, as one
+// transaction: the sets are issued back to back so apps never see a stale
+// pairing for long, and if any of them fails the roles already changed are
+// put back. Output goes last, so --wait confirms it only after the others are
+// in place and a timeout there still rolls everything back.
+static int switchAllRoles(DeviceSnapshot *snap, const char *deviceName, const char *progName,
+                          const CommandOptions *options, FILE *out, FILE *err) {
+    const DeviceInfo *dev;
+    // An input-only device still takes the input role.
+    if (findDeviceByName(snap, ROLE_OUTPUT, deviceName, &dev) == MATCH_NONE) {
+        dev = resolveNamedDevice(snap, ROLE_INPUT, deviceName, progName, err);
+    } else {
+        dev = resolveNamedDevice(snap, ROLE_OUTPUT, deviceName, progName, err);
+    }
+    if (!dev) {
+        return 1;
+    }
+
+    static const DeviceRole order[] = { ROLE_INPUT, ROLE_SYSTEM, ROLE_OUTPUT };
+    AudioDeviceID previous[ROLE_COUNT];
+    DeviceRole changed[ROLE_COUNT];
+    int changedCount = 0;
+    double confirmMs = -1;
+    // Every role gets --retry; only output, which goes last, waits.
+    CommandOptions retryOnly = *options;
+    retryOnly.waitForSwitch = false;
+
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        DeviceRole role = order[i];
+        previous[role] = snap->defaults[role];
+        if (!deviceHasRole(dev, role) || previous[role] == dev->id) {
+            continue;
+        }
+
+        OSStatus status = switchDefaultDevice(role, dev->id, role == ROLE_OUTPUT ? options : &retryOnly,
+                                              &confirmMs);
+        if (status != noErr) {
+            printSwitchError(status, role, dev, options, err);
+            // A timed-out output switch may still land late; undo it too.
+            if (role == ROLE_OUTPUT && status == kSwitchTimedOutError) {
+                changed[changedCount++] = role;
+            }
+            DeviceRole stuck[ROLE_COUNT];
+            int stuckCount = 0;
+            bool restored = changedCount > 0;
+            while (changedCount > 0) {
+                DeviceRole undo = changed[--changedCount];
+                if (previous[undo] == kAudioObjectUnknown || setDefaultDevice(undo, previous[undo]) != noErr) {
+                    stuck[stuckCount++] = undo;
+                }
+            }
+            if (stuckCount > 0) {
+                char roles[64];
+                joinRoleNames(stuck, stuckCount, roles, sizeof(roles));
+                fprintf(err, "Could not restore the previous default %s device%s.\n",
+                        roles, stuckCount > 1 ? "s" : "");
+            } else if (restored) {
+                fprintf(err, "Previous defaults restored.\n");
+            }
+            return 1;
+        }
+        changed[changedCount++] = role;
+    }
+
+    DeviceRole served[ROLE_COUNT];
+    int servedCount = 0;
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        if (deviceHasRole(dev, (DeviceRole)role)) {
+            snap->defaults[role] = dev->id;
+            served[servedCount++] = (DeviceRole)role;
+        }
+    }
+    char roles[64];
+    joinRoleNames(served, servedCount, roles, sizeof(roles));
+    fprintf(out, "Switched default %s to \"%s\".\n", roles, dev->name);
+    printConfirmation(confirmMs, out);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Aggregate devices
+//
+// --aggregate builds a multi-output (stacked) aggregate from devices named
+// like any other argument and makes it the default output; --teardown
+// removes it again. The aggregate's UID is derived from its name, so a script
+// can tear down what it built without remembering an ID. The clock comes
+// from the member with the steadiest transport, and every other member gets
+// drift correction, which is what Audio MIDI Setup users end up choosing by
+// hand.
+// ---------------------------------------------------------------------------
+
+#define DEFAULT_AGGREGATE_NAME "switch_audio Multi-Output"
+#define AGGREGATE_UID_PREFIX "com.github.tungmv.switch_audio.aggregate:"
+#define MAX_AGGREGATE_MEMBERS 16
+
+// Lower is a better clock source: built-in and wired interfaces run off
+// stable crystals, Bluetooth and AirPlay endpoints resample on their own.
+static int clockRank(UInt32 transportType) {
+    switch (transportType) {
+    case kAudioDeviceTransportTypeBuiltIn: return 0;
+    case kAudioDeviceTransportTypeUSB:
+    case kAudioDeviceTransportTypePCI:
+    case kAudioDeviceTransportTypeFireWire:
+    case kAudioDeviceTransportTypeThunderbolt:
+    case kAudioDeviceTransportTypeAVB: return 1;
+    case kAudioDeviceTransportTypeHDMI:
+    case kAudioDeviceTransportTypeDisplayPort: return 2;
+    case kAudioDeviceTransportTypeVirtual: return 3;
+    case kAudioDeviceTransportTypeAirPlay: return 4;
+    case kAudioDeviceTransportTypeBluetooth: return 5;
+    default: return 3;
+    }
+}
+
+static bool getAggregateUID(const char *name, char *uid, size_t size) {
+    return (size_t)snprintf(uid, size, "%s%s", AGGREGATE_UID_PREFIX, name) < size;
+}
+
+static void setDictionaryString(CFMutableDictionaryRef dict, const char *key, const char *value) {
+    CFStringRef keyString = CFStringCreateWithCString(kCFAllocatorDefault, key, kCFStringEncodingUTF8);
+    CFStringRef valueString = CFStringCreateWithCString(kCFAllocatorDefault, value, kCFStringEncodingUTF8);
+    if (keyString && valueString) {
+        CFDictionarySetValue(dict, keyString, valueString);
+    }
+    if (keyString) {
+        CFRelease(keyString);
+    }
+    if (valueString) {
+        CFRelease(valueString);
+    }
+}
+
+// The aggregate flags are documented as CFNumbers, not CFBooleans.
+static void setDictionaryInt(CFMutableDictionaryRef dict, const char *key, int value) {
+    CFStringRef keyString = CFStringCreateWithCString(kCFAllocatorDefault, key, kCFStringEncodingUTF8);
+    CFNumberRef number = CFNumberCreate(kCFAllocatorDefault, kCFNumberIntType, &value);
+    if (keyString && number) {
+        CFDictionarySetValue(dict, keyString, number);
+    }
+    if (keyString) {
+        CFRelease(keyString);
+    }
+    if (number) {
+        CFRelease(number);
+    }
+}
+
+static AudioDeviceID createAggregateDevice(const char *name, const char *uid, const DeviceInfo *const *members,
+                                           int memberCount, const DeviceInfo *clock, OSStatus *status) {
+    CFMutableDictionaryRef description = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                                   &kCFTypeDictionaryKeyCallBacks,
+                                                                   &kCFTypeDictionaryValueCallBacks);
+    CFMutableArrayRef subDevices = CFArrayCreateMutable(kCFAllocatorDefault, memberCount, &kCFTypeArrayCallBacks);
+    CFStringRef subDevicesKey = CFStringCreateWithCString(kCFAllocatorDefault, kAudioAggregateDeviceSubDeviceListKey,
+                                                          kCFStringEncodingUTF8);
+    AudioDeviceID deviceID = kAudioObjectUnknown;
+    *status = kAudioHardwareIllegalOperationError;
+    if (!description || !subDevices || !subDevicesKey) {
+        goto done;
+    }
+
+    setDictionaryString(description, kAudioAggregateDeviceNameKey, name);
+    setDictionaryString(description, kAudioAggregateDeviceUIDKey, uid);
+    setDictionaryString(description, kAudioAggregateDeviceMainSubDeviceKey, clock->uid);
+    setDictionaryString(description, kAudioAggregateDeviceClockDeviceKey, clock->uid);
+    // Stacked: every member plays the same channels. Public, so the device
+    // outlives this process.
+    setDictionaryInt(description, kAudioAggregateDeviceIsStackedKey, 1);
+    setDictionaryInt(description, kAudioAggregateDeviceIsPrivateKey, 0);
+
+    for (int i = 0; i < memberCount; i++) {
+        CFMutableDictionaryRef sub = CFDictionaryCreateMutable(kCFAllocatorDefault, 0,
+                                                               &kCFTypeDictionaryKeyCallBacks,
+                                                               &kCFTypeDictionaryValueCallBacks);
+        if (!sub) {
+            goto done;
+        }
+        setDictionaryString(sub, kAudioSubDeviceUIDKey, members[i]->uid);
+        setDictionaryInt(sub, kAudioSubDeviceDriftCompensationKey, members[i] != clock);
+        CFArrayAppendValue(subDevices, sub);
+        CFRelease(sub);
+    }
+    CFDictionarySetValue(description, subDevicesKey, subDevices);
+
+    *status = AudioHardwareCreateAggregateDevice(description, &deviceID);
+    if (*status != noErr) {
+        deviceID = kAudioObjectUnknown;
+    }
+
+done:
+    if (subDevicesKey) {
+        CFRelease(subDevicesKey);
+    }
+    if (subDevices) {
+        CFRelease(subDevices);
+    }
+    if (description) {
+        CFRelease(description);
+    }
+    return deviceID;
+}
+
+static int buildAggregate(DeviceSnapshot *snap, const char *memberList, const char *progName,
+                          const CommandOptions *options, FILE *out, FILE *err) {
+    const char *name = options->aggregateName ? options->aggregateName : DEFAULT_AGGREGATE_NAME;
+    char uid[512];
+    if (!getAggregateUID(name, uid, sizeof(uid))) {
+        fprintf(err, "Aggregate name \"%s\" is too long.\n", name);
+        return 1;
+    }
+    // Asked of the HAL directly: --hide-virtual or --only may have kept the
+    // aggregate out of the snapshot.
+    if (translateUIDToDevice(uid) != kAudioObjectUnknown) {
+        fprintf(err, "Aggregate \"%s\" already exists; remove it with '%s --teardown \"%s\"'.\n",
+                name, progName, name);
+        return 1;
+    }
+
+    const DeviceInfo *members[MAX_AGGREGATE_MEMBERS];
+    int memberCount = 0;
+    const DeviceInfo *clock = NULL;
+    for (const char *item = memberList; item; ) {
+        const char *itemEnd = strchr(item, ',');
+        const char *next = itemEnd ? itemEnd + 1 : NULL;
+        if (!itemEnd) {
+            itemEnd = item + strlen(item);
+        }
+        trimSpan(&item, &itemEnd);
+
+        char memberName[256];
+        size_t len = (size_t)(itemEnd - item);
+        if (len == 0 || len >= sizeof(memberName)) {
+            fprintf(err, "Error: --aggregate needs a comma-separated list of device names.\n");
+            return 1;
+        }
+        memcpy(memberName, item, len);
+        memberName[len] = '\0';
+
+        const DeviceInfo *dev = resolveNamedDevice(snap, ROLE_OUTPUT, memberName, progName, err);
+        if (!dev) {
+            return 1;
+        }
+        if (!dev->uid) {
+            fprintf(err, "\"%s\" has no UID and cannot join an aggregate.\n", dev->name);
+            return 1;
+        }
+        for (int i = 0; i < memberCount; i++) {
+            if (members[i] == dev) {
+                fprintf(err, "\"%s\" is listed twice.\n", dev->name);
+                return 1;
+            }
+        }
+        if (memberCount == MAX_AGGREGATE_MEMBERS) {
+            fprintf(err, "An aggregate can have at most %d devices.\n", MAX_AGGREGATE_MEMBERS);
+            return 1;
+        }
+        members[memberCount++] = dev;
+        if (!clock || clockRank(dev->transportType) < clockRank(clock->transportType)) {
+            clock = dev;
+        }
+        item = next;
+    }
+    if (memberCount < 2) {
+        fprintf(err, "Error: --aggregate needs at least two devices.\n");
+        return 1;
+    }
+
+    OSStatus status;
+    AudioDeviceID deviceID = createAggregateDevice(name, uid, members, memberCount, clock, &status);
+    if (deviceID == kAudioObjectUnknown) {
+        fprintf(err, "Failed to create aggregate \"%s\" (error %d).\n", name, (int)status);
+        return 1;
+    }
+    fprintf(out, "Created \"%s\" from %d devices, clocked by \"%s\" with drift correction on the rest.\n",
+            name, memberCount, clock->name);
+
+    double confirmMs;
+    status = switchDefaultDevice(ROLE_OUTPUT, deviceID, options, &confirmMs);
+    if (status != noErr) {
+        DeviceInfo target = { .id = deviceID, .name = (char *)name };
+        printSwitchError(status, ROLE_OUTPUT, &target, options, err);
+        return 1;
+    }
+    snap->defaults[ROLE_OUTPUT] = deviceID;
+    fprintf(out, "Switched default output to \"%s\".\n", name);
+    printConfirmation(confirmMs, out);
+    return 0;
+}
+
+// Accepts the name given to --aggregate (which maps to its UID, looked up
+// without the transport filter) or anything that names an existing aggregate
+// device.
+static int teardownAggregate(DeviceSnapshot *snap, const char *deviceName, const char *progName,
+                             FILE *out, FILE *err) {
+    char uid[512];
+    AudioDeviceID deviceID = kAudioObjectUnknown;
+    const char *name = deviceName;
+    if (getAggregateUID(deviceName, uid, sizeof(uid))) {
+        deviceID = translateUIDToDevice(uid);
+    }
+    if (deviceID == kAudioObjectUnknown) {
+        const DeviceInfo *dev = resolveNamedDevice(snap, ROLE_OUTPUT, deviceName, progName, err);
+        if (!dev) {
+            return 1;
+        }
+        deviceID = dev->id;
+        name = dev->name;
+    }
+    UInt32 transportType = 0;
+    getUInt32Property(deviceID, kAudioDevicePropertyTransportType, kAudioObjectPropertyScopeGlobal, &transportType);
+    if (transportType != kAudioDeviceTransportTypeAggregate) {
+        fprintf(err, "\"%s\" is not an aggregate device.\n", name);
+        return 1;
+    }
+
+    OSStatus status = AudioHardwareDestroyAggregateDevice(deviceID);
+    if (status != noErr) {
+        fprintf(err, "Failed to remove \"%s\" (error %d).\n", name, (int)status);
+        return 1;
+    }
+    fprintf(out, "Removed \"%s\".\n", name);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Rotation sets
+//
+// ~/.config/switch_audio/sets (or SWITCH_AUDIO_SETS) names the devices -n
+// should cycle through, e.g. "desk = phones, <Scarlett UID>", so virtual
+// loopbacks and the like never come up. Members are UIDs or aliases, stored
+// by UID so they survive renames and reboots. A set is resolved once per
+// snapshot; the daemon's long-lived snapshot keeps the resolved order across
+// hotkey presses until a hotplug event or an edit to either file. One-shot
+// runs keep the last resolved set in the disk cache next to the devices, so
+// a later -n --set on the same device list reads neither file.
+// ---------------------------------------------------------------------------
+
+static RotationCycle* resolveRotationCycle(DeviceSnapshot *snap, DeviceRole role, const char *setName, FILE *err) {
+    char keyBuf[256];
+    char *key = normalizeName(setName, keyBuf, sizeof(keyBuf));
+    if (!key) {
+        return NULL;
+    }
+    RotationCycle *cycle = &snap->cycle;
+    bool cached = cycle->setKey && cycle->role == role && strcmp(cycle->setKey, key) == 0;
+    if (cached && cycle->stored) {
+        cached = sameConfigStamp(cycle->setStamp, stampConfigFile(&setTable))
+            && sameConfigStamp(cycle->aliasStamp, stampConfigFile(&aliasTable));
+    } else if (cached) {
+        cached = cycle->setGeneration == setTable.generation && cycle->aliasGeneration == aliasTable.generation;
+    }
+    if (!cached) {
+        const char *members = lookupConfigEntry(&setTable, setName);
+        if (!members) {
+            fprintf(err, "Unknown rotation set \"%s\".\n", setName);
+            if (key != keyBuf) {
+                free(key);
+            }
+            return NULL;
+        }
+        refreshConfigTable(&aliasTable);
+
+        // Re-resolving leaves the old order in the snapshot arena; that only
+        // happens when a file or the set changes, so it stays small.
+        UInt32 entries = 1;
+        for (const char *c = members; *c; c++) {
+            entries += *c == ',';
+        }
+        UInt32 *order = arenaAlloc(&snap->arena, entries * sizeof(UInt32));
+        char *setKey = arenaStrdup(&snap->arena, key);
+        if (!order || !setKey) {
+            if (key != keyBuf) {
+                free(key);
+            }
+            return NULL;
+        }
+
+        UInt32 count = 0;
+        for (const char *item = members; item; ) {
+            const char *itemEnd = strchr(item, ',');
+            const char *next = itemEnd ? itemEnd + 1 : NULL;
+            if (!itemEnd) {
+                itemEnd = item + strlen(item);
+            }
+            trimSpan(&item, &itemEnd);
+
+            char uid[256];
+            size_t len = (size_t)(itemEnd - item);
+            if (len > 0 && len < sizeof(uid)) {
+                memcpy(uid, item, len);
+                uid[len] = '\0';
+                const char *aliasUID = lookupAlias(uid);
+                const DeviceInfo *dev = findDeviceByUID(snap, role, aliasUID ? aliasUID : uid);
+                if (dev) {
+                    order[count++] = (UInt32)(dev - snap->devices);
+                }
+            }
+            item = next;
+        }
+        *cycle = (RotationCycle){
+            .setKey = setKey,
+            .role = role,
+            .setGeneration = setTable.generation,
+            .aliasGeneration = aliasTable.generation,
+            .setStamp = { .mtime = setTable.mtime, .size = setTable.size },
+            .aliasStamp = { .mtime = aliasTable.mtime, .size = aliasTable.size },
+            .members = order,
+            .count = count
+        };
+        snap->cycleChanged = true;
+    }
+    if (key != keyBuf) {
+        free(key);
+    }
+
+    if (cycle->count == 0) {
+        fprintf(err, "No %s device in rotation set \"%s\" is connected.\n", roleNames[role], setName);
+        return NULL;
+    }
+    return cycle;
+}
+
+// ---------------------------------------------------------------------------
+// Volume and mute
+//
+// --volume and --mute act on the role's default device as the snapshot sees
+// it, so after a switch earlier on the same line they hit the new device
+// without resolving it again: "switch_audio Speakers --volume 30" is one
+// process and one lookup. The virtual main volume is preferred because it
+// keeps the channel balance; devices without one get VolumeScalar on the
+// main element, or on every channel when only per-channel controls exist.
+// ---------------------------------------------------------------------------
+
+// Accepts "30" (absolute percent) or "+10"/"-10" (a step from the current
+// volume).
+static bool parseVolume(const char *arg, long *percent, bool *relative) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value < -100 || value > 100) {
+        return false;
+    }
+    *relative = arg[0] == '+' || arg[0] == '-';
+    *percent = value;
+    return true;
+}
+
+static bool getDeviceVolume(AudioDeviceID deviceID, AudioObjectPropertyScope scope, Float32 *volume) {
+    AudioObjectPropertyAddress addr = {
+        .mSelector = kAudioDevicePropertyVolumeScalar,
+        .mScope = scope,
+        .mElement = kAudioObjectPropertyElementMain
+    };
+    UInt32 size;
+#ifndef SWITCH_AUDIO_NO_AUDIOTOOLBOX
+    addr.mSelector = kAudioHardwareServiceDeviceProperty_VirtualMainVolume;
+    size = sizeof(*volume);
+    if (halServiceGetPropertyData(deviceID, &addr, &size, volume) == noErr) {
+        return true;
+    }
+    addr.mSelector = kAudioDevicePropertyVolumeScalar;
+#endif
+    size = sizeof(*volume);
+    if (halGetPropertyData(deviceID, &addr, 0, NULL, &size, volume) == noErr) {
+        return true;
+    }
+    addr.mElement = 1;
+    size = sizeof(*volume);
+    return halGetPropertyData(deviceID, &addr, 0, NULL, &size, volume) == noErr;
+}
+
+static OSStatus setDeviceVolume(AudioDeviceID deviceID, AudioObjectPropertyScope scope, UInt32 channels,
+                                Float32 volume) {
+    AudioObjectPropertyAddress addr = {
+        .mSelector = kAudioDevicePropertyVolumeScalar,
+        .mScope = scope,
+        .mElement = kAudioObjectPropertyElementMain
+    };
+#ifndef SWITCH_AUDIO_NO_AUDIOTOOLBOX
+    addr.mSelector = kAudioHardwareServiceDeviceProperty_VirtualMainVolume;
+    if (halServiceSetPropertyData(deviceID, &addr, sizeof(volume), &volume) == noErr) {
+        return noErr;
+    }
+    addr.mSelector = kAudioDevicePropertyVolumeScalar;
+#endif
+    OSStatus status = halSetPropertyData(deviceID, &addr, 0, NULL, sizeof(volume), &volume);
+    if (status == noErr) {
+        return noErr;
+    }
+    for (UInt32 channel = 1; channel <= channels; channel++) {
+        addr.mElement = channel;
+        status = halSetPropertyData(deviceID, &addr, 0, NULL, sizeof(volume), &volume);
+        if (status != noErr) {
+            break;
+        }
+    }
+    return status;
+}
+
+static OSStatus setDeviceMute(AudioDeviceID deviceID, AudioObjectPropertyScope scope, bool mute) {
+    AudioObjectPropertyAddress addr = {
+        .mSelector = kAudioDevicePropertyMute,
+        .mScope = scope,
+        .mElement = kAudioObjectPropertyElementMain
+    };
+    UInt32 value = mute;
+    return halSetPropertyData(deviceID, &addr, 0, NULL, sizeof(value), &value);
+}
+
+// The device a volume or format action applies to: the role's default as the
+// snapshot sees it. Lines without a snapshot (--uid only) read the default
+// and the name from the HAL instead.
+typedef struct {
+    AudioDeviceID id;
+    DeviceInfo *info;       // NULL without a snapshot
+    const char *name;
+    char *fetchedName;
+} ActionTarget;
+
+static bool resolveActionTarget(DeviceSnapshot *snap, DeviceRole role, ActionTarget *target, FILE *err) {
+    target->id = snap ? snap->defaults[role] : getCurrentDefaultDevice(role);
+    if (target->id == kAudioObjectUnknown) {
+        fprintf(err, "No default %s device.\n", roleNames[role]);
+        return false;
+    }
+    target->info = snap ? (DeviceInfo *)findSnapshotDevice(snap, target->id) : NULL;
+    target->fetchedName = target->info ? NULL : getDeviceName(target->id);
+    target->name = target->info ? target->info->name : target->fetchedName;
+    if (!target->name) {
+        target->name = "Unknown";
+    }
+    return true;
+}
+
+static void releaseActionTarget(ActionTarget *target) {
+    free(target->fetchedName);
+}
+
+// Applies --volume (volumeArg set) or --mute/--unmute to the role's default
+// device.
+static int changeDeviceVolume(DeviceSnapshot *snap, const char *volumeArg, bool mute,
+                              const CommandOptions *options, FILE *out, FILE *err) {
+    DeviceRole role = options->role;
+    AudioObjectPropertyScope scope = roleScope(role);
+    ActionTarget target;
+    if (!resolveActionTarget(snap, role, &target, err)) {
+        return 1;
+    }
+    AudioDeviceID deviceID = target.id;
+    const char *name = target.name;
+
+    UInt32 channels = 0;
+    if (target.info) {
+        channels = deviceChannels(target.info, role);
+    } else {
+        deviceSupportsScope(deviceID, scope, &channels);
+    }
+
+    int result = 0;
+    if (volumeArg) {
+        long percent;
+        bool relative;
+        parseVolume(volumeArg, &percent, &relative);
+        Float32 volume = (Float32)percent / 100.0f;
+        Float32 current;
+        if (relative && !getDeviceVolume(deviceID, scope, &current)) {
+            fprintf(err, "\"%s\" has no adjustable %s volume.\n", name, roleNames[role]);
+            releaseActionTarget(&target);
+            return 1;
+        }
+        if (relative) {
+            volume = current + volume;
+        }
+        volume = volume < 0.0f ? 0.0f : volume > 1.0f ? 1.0f : volume;
+
+        if (setDeviceVolume(deviceID, scope, channels, volume) == noErr) {
+            fprintf(out, "Set %s volume of \"%s\" to %.0f%%.\n", roleNames[role], name,
+                    volume * 100.0f);
+        } else {
+            fprintf(err, "\"%s\" has no adjustable %s volume.\n", name, roleNames[role]);
+            result = 1;
+        }
+    } else if (setDeviceMute(deviceID, scope, mute) == noErr) {
+        fprintf(out, "%s \"%s\".\n", mute ? "Muted" : "Unmuted", name);
+    } else {
+        fprintf(err, "\"%s\" cannot be muted.\n", name);
+        result = 1;
+    }
+    releaseActionTarget(&target);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Sample rate and buffer size
+//
+// --rate and --buffer retune the role's default device, typically right
+// after switching to it, so a live-monitoring setup is one command instead
+// of a trip to Audio MIDI Setup. Requests are checked against the device's
+// advertised rates and buffer range, which are read on first use and kept in
+// the snapshot with the rest of the device's data.
+// ---------------------------------------------------------------------------
+
+static bool parseSampleRate(const char *arg, Float64 *rate) {
+    char *end;
+    double value = strtod(arg, &end);
+    if (*arg == '\0' || *end != '\0' || !(value >= 1000.0 && value <= 1000000.0)) {
+        return false;
+    }
+    *rate = value;
+    return true;
+}
+
+static bool parseBufferFrames(const char *arg, UInt32 *frames) {
+    char *end;
+    long value = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || value < 1 || value > 65536) {
+        return false;
+    }
+    *frames = (UInt32)value;
+    return true;
+}
+
+// Fills in the available rates and buffer range once; a device that reports
+// neither ends up with empty (zero) ranges that reject every request.
+static void ensureDeviceFormats(Arena *arena, DeviceInfo *info) {
+    if (info->availableRates) {
+        return;
+    }
+    AudioObjectPropertyAddress addr = {
+        .mSelector = kAudioDevicePropertyAvailableNominalSampleRates,
+        .mScope = kAudioObjectPropertyScopeGlobal,
+        .mElement = kAudioObjectPropertyElementMain
+    };
+    UInt32 size = 0;
+    if (halGetPropertyDataSize(info->id, &addr, 0, NULL, &size) != noErr) {
+        size = 0;
+    }
+    UInt32 count = size / sizeof(AudioValueRange);
+    info->availableRates = arenaCalloc(arena, count ? count : 1, sizeof(AudioValueRange));
+    if (!info->availableRates) {
+        return;
+    }
+    size = count * sizeof(AudioValueRange);
+    if (count && halGetPropertyData(info->id, &addr, 0, NULL, &size, info->availableRates) == noErr) {
+        info->availableRateCount = size / sizeof(AudioValueRange);
+    }
+
+    addr.mSelector = kAudioDevicePropertyBufferFrameSizeRange;
+    size = sizeof(info->bufferRange);
+    if (halGetPropertyData(info->id, &addr, 0, NULL, &size, &info->bufferRange) != noErr) {
+        info->bufferRange = (AudioValueRange){ 0, 0 };
+    }
+}
+
+static bool rateSupported(const DeviceInfo *info, Float64 rate) {
+    for (UInt32 i = 0; i < info->availableRateCount; i++) {
+        if (rate >= info->availableRates[i].mMinimum && rate <= info->availableRates[i].mMaximum) {
+            return true;
+        }
+    }
+    return false;
+}
+
+static void printAvailableRates(const DeviceInfo *info, FILE *out) {
+    for (UInt32 i = 0; i < info->availableRateCount; i++) {
+        const AudioValueRange *range = &info->availableRates[i];
+        fprintf(out, i ? ", %.0f" : "%.0f", range->mMinimum);
+        if (range->mMaximum != range->mMinimum) {
+            fprintf(out, "-%.0f", range->mMaximum);
+        }
+    }
+}
+
+// Both expect ensureDeviceFormats() to have run on info.
+static bool setDeviceRate(DeviceInfo *info, const char *name, Float64 rate, FILE *err) {
+    AudioObjectPropertyAddress addr = {
+        kAudioDevicePropertyNominalSampleRate,
+        kAudioObjectPropertyScopeGlobal,
+        kAudioObjectPropertyElementMain
+    };
+    if (!rateSupported(info, rate)) {
+        fprintf(err, "%.0f Hz is not supported by \"%s\" (available: ", rate, name);
+        printAvailableRates(info, err);
+        fprintf(err, ").\n");
+        return false;
+    }
+    if (halSetPropertyData(info->id, &addr, 0, NULL, sizeof(rate), &rate) != noErr) {
+        fprintf(err, "Failed to set the sample rate of \"%s\".\n", name);
+        return false;
+    }
+    info->sampleRate = rate;
+    return true;
+}
+
+static bool setDeviceBufferFrames(DeviceInfo *info, const char *name, UInt32 frames, FILE *err) {
+    AudioObjectPropertyAddress addr = {
+        kAudioDevicePropertyBufferFrameSize,
+        kAudioObjectPropertyScopeGlobal,
+        kAudioObjectPropertyElementMain
+    };
+    if (frames < info->bufferRange.mMinimum || frames > info->bufferRange.mMaximum) {
+        fprintf(err, "A %u-frame buffer is outside the %.0f-%.0f frame range of \"%s\".\n",
+                (unsigned)frames, info->bufferRange.mMinimum, info->bufferRange.mMaximum, name);
+        return false;
+    }
+    if (halSetPropertyData(info->id, &addr, 0, NULL, sizeof(frames), &frames) != noErr) {
+        fprintf(err, "Failed to set the buffer size of \"%s\".\n", name);
+        return false;
+    }
+    info->latencyKnown = false;
+    return true;
+}
+
+// Applies --rate (rateArg set) or --buffer (bufferArg set) to the role's
+// default device.
+static int changeDeviceFormat(DeviceSnapshot *snap, const char *rateArg, const char *bufferArg,
+                              const CommandOptions *options, FILE *out, FILE *err) {
+    ActionTarget target;
+    if (!resolveActionTarget(snap, options->role, &target, err)) {
+        return 1;
+    }
+    // Without a snapshot the formats live only as long as this action.
+    Arena scratch = { 0 };
+    DeviceInfo scratchInfo = { .id = target.id };
+    DeviceInfo *info = target.info ? target.info : &scratchInfo;
+    ensureDeviceFormats(target.info ? &snap->arena : &scratch, info);
+
+    int result = 1;
+    if (rateArg) {
+        Float64 rate;
+        parseSampleRate(rateArg, &rate);
+        if (setDeviceRate(info, target.name, rate, err)) {
+            fprintf(out, "Set sample rate of \"%s\" to %.0f Hz.\n", target.name, rate);
+            result = 0;
+        }
+    } else {
+        UInt32 frames;
+        parseBufferFrames(bufferArg, &frames);
+        if (setDeviceBufferFrames(info, target.name, frames, err)) {
+            fprintf(out, "Set buffer size of \"%s\" to %u frames.\n", target.name, (unsigned)frames);
+            result = 0;
+        }
+    }
+
+    freeArena(&scratch);
+    releaseActionTarget(&target);
+    return result;
+}
+
+// ---------------------------------------------------------------------------
+// Scenes
+//
+// A scene records the default output, input and system device by UID, along
+// with each device's volume, sample rate and buffer size, as one line of
+// ~/.config/switch_audio/scenes (or SWITCH_AUDIO_SCENES):
+//
+//   podcast = output "UID" volume 30 rate 48000 buffer 64; input "UID" volume 80
+//
+// --save-scene writes the current state under a name and --scene applies it.
+// Every UID is resolved up front, using the snapshot's index, or one
+// translation per distinct UID when there is no snapshot, and every value is
+// validated before anything changes. Then formats are applied, then volumes,
+// and the defaults last, so audio reaches a device that is already configured.
+// Each change is logged with the value it replaced; if a later one fails,
+// the log is undone in reverse, the way --all rolls back its roles.
+// ---------------------------------------------------------------------------
+
+#define SCENE_MAX_WORDS 16
+
+typedef struct {
+    bool present;
+    const char *uid;
+    long volume;            // percent, or -1 when the scene leaves it alone
+    Float64 rate;           // 0 when unset
+    UInt32 bufferFrames;    // 0 when unset
+    DeviceInfo *info;       // resolved device; scratch below without a snapshot
+    DeviceInfo scratch;
+    UInt32 channels;
+    char *fetchedName;
+} SceneRole;
+
+static ConfigTable sceneTable = {
+    .envName = "SWITCH_AUDIO_SCENES",
+    .fileName = "scenes",
+    .valueLabel = "ROLE UID [volume N] [rate HZ] [buffer N]; ...",
+    .quoted = true
+};
+
+static int splitCommandLine(char *line, char **words, int maxWords);
+
+// Parses a scene definition in place; the UIDs point into text.
+static bool parseScene(const char *sceneName, char *text, SceneRole roles[ROLE_COUNT], FILE *err) {
+    for (char *segment = text; segment; ) {
+        char *end = strchr(segment, ';');
+        if (end) {
+            *end = '\0';
+        }
+        char *words[SCENE_MAX_WORDS];
+        int count = splitCommandLine(segment, words, SCENE_MAX_WORDS);
+        segment = end ? end + 1 : NULL;
+        if (count == 0) {
+            continue;
+        }
+
+        DeviceRole role;
+        bool ok = count >= 2 && count % 2 == 0 && parseDeviceRole(words[0], &role) && !roles[role].present;
+        if (ok) {
+            SceneRole *entry = &roles[role];
+            entry->present = true;
+            entry->uid = words[1];
+            for (int i = 2; ok && i < count; i += 2) {
+                bool relative;
+                if (strcmp(words[i], "volume") == 0) {
+                    ok = parseVolume(words[i + 1], &entry->volume, &relative) && !relative;
+                } else if (strcmp(words[i], "rate") == 0) {
+                    ok = parseSampleRate(words[i + 1], &entry->rate);
+                } else if (strcmp(words[i], "buffer") == 0) {
+                    ok = parseBufferFrames(words[i + 1], &entry->bufferFrames);
+                } else {
+                    ok = false;
+                }
+            }
+        }
+        if (!ok) {
+            fprintf(err, "Scene \"%s\": expected \"%s\" for each role, once.\n", sceneName, sceneTable.valueLabel);
+            return false;
+        }
+    }
+    return true;
+}
+
+// Finds the device for every role the scene names. Returns false, having
+// explained why, if any of them is missing.
+static bool resolveSceneDevices(DeviceSnapshot *snap, const char *sceneName, SceneRole roles[ROLE_COUNT],
+                                FILE *err) {
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        SceneRole *entry = &roles[role];
+        if (!entry->present) {
+            continue;
+        }
+        if (snap) {
+            const DeviceInfo *dev = findDeviceByUID(snap, (DeviceRole)role, entry->uid);
+            if (dev && !dev->unresponsive) {
+                entry->info = (DeviceInfo *)dev;
+                entry->channels = deviceChannels(dev, (DeviceRole)role);
+            }
+        } else {
+            // Output and system output usually share a device.
+            for (int prior = 0; prior < role && !entry->info; prior++) {
+                if (roles[prior].info && strcmp(roles[prior].uid, entry->uid) == 0
+                    && deviceSupportsScope(roles[prior].info->id, roleScope((DeviceRole)role), &entry->channels)) {
+                    entry->info = roles[prior].info;
+                }
+            }
+            AudioDeviceID deviceID = entry->info ? kAudioObjectUnknown : translateUIDToDevice(entry->uid);
+            if (deviceID != kAudioObjectUnknown
+                && deviceSupportsScope(deviceID, roleScope((DeviceRole)role), &entry->channels)) {
+                entry->scratch.id = deviceID;
+                entry->scratch.name = entry->fetchedName = getDeviceName(deviceID);
+                entry->info = &entry->scratch;
+            }
+        }
+        if (!entry->info) {
+            fprintf(err, "Scene \"%s\" needs %s device %s, which is not connected.\n",
+                    sceneName, roleNames[role], entry->uid);
+            return false;
+        }
+    }
+    return true;
+}
+
+static const char* sceneDeviceName(const SceneRole *entry) {
+    return entry->info->name ? entry->info->name : entry->uid;
+}
+
+typedef enum {
+    SCENE_UNDO_RATE,
+    SCENE_UNDO_BUFFER,
+    SCENE_UNDO_VOLUME,
+    SCENE_UNDO_DEFAULT
+} SceneUndoKind;
+
+typedef struct {
+    SceneUndoKind kind;
+    DeviceRole role;
+    SceneRole *entry;
+    union {
+        Float64 rate;
+        UInt32 frames;
+        Float32 volume;
+        AudioDeviceID device;
+    } previous;
+} SceneUndo;
+
+// At most one of each kind per role.
+#define SCENE_MAX_UNDO (4 * ROLE_COUNT)
+
+// Puts back everything in the log, newest first. Returns whether all of it
+// was restored; each failure has been reported.
+static bool undoScene(DeviceSnapshot *snap, const SceneUndo *log, int count, FILE *err) {
+    bool restored = true;
+    while (count > 0) {
+        const SceneUndo *undo = &log[--count];
+        SceneRole *entry = undo->entry;
+        switch (undo->kind) {
+        case SCENE_UNDO_RATE:
+            restored &= setDeviceRate(entry->info, sceneDeviceName(entry), undo->previous.rate, err);
+            break;
+        case SCENE_UNDO_BUFFER:
+            restored &= setDeviceBufferFrames(entry->info, sceneDeviceName(entry), undo->previous.frames, err);
+            break;
+        case SCENE_UNDO_VOLUME:
+            if (setDeviceVolume(entry->info->id, roleScope(undo->role), entry->channels,
+                                undo->previous.volume) != noErr) {
+                fprintf(err, "Could not restore the %s volume of \"%s\".\n", roleNames[undo->role],
+                        sceneDeviceName(entry));
+                restored = false;
+            }
+            break;
+        case SCENE_UNDO_DEFAULT:
+            if (undo->previous.device == kAudioObjectUnknown
+                || setDefaultDevice(undo->role, undo->previous.device) != noErr) {
+                fprintf(err, "Could not restore the previous default %s device.\n", roleNames[undo->role]);
+                restored = false;
+            } else if (snap) {
+                snap->defaults[undo->role] = undo->previous.device;
+            }
+            break;
+        }
+    }
+    return restored;
+}
+
+static int applyScene(DeviceSnapshot *snap, const char *sceneName, const CommandOptions *options,
+                      FILE *out, FILE *err) {
+    const char *definition = lookupConfigEntry(&sceneTable, sceneName);
+    if (!definition) {
+        fprintf(err, "Unknown scene \"%s\".\n", sceneName);
+        return 1;
+    }
+    size_t len = strlen(definition);
+    char *text = tracedMalloc(len + 1);
+    if (!text) {
+        return 1;
+    }
+    memcpy(text, definition, len + 1);
+
+    SceneRole roles[ROLE_COUNT] = { { 0 } };
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        roles[role].volume = -1;
+    }
+    Arena scratch = { 0 };
+    SceneUndo undo[SCENE_MAX_UNDO];
+    int undoCount = 0;
+    int result = 1;
+    if (!parseScene(sceneName, text, roles, err) || !resolveSceneDevices(snap, sceneName, roles, err)) {
+        goto done;
+    }
+
+    // Validate every format change before making any of them.
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        SceneRole *entry = &roles[role];
+        if (!entry->present || (!entry->rate && !entry->bufferFrames)) {
+            continue;
+        }
+        // Without a snapshot a role may share an earlier role's scratch info.
+        ensureDeviceFormats(snap ? &snap->arena : &scratch, entry->info);
+        if (entry->rate && !rateSupported(entry->info, entry->rate)) {
+            fprintf(err, "Scene \"%s\": %.0f Hz is not supported by \"%s\".\n", sceneName, entry->rate,
+                    sceneDeviceName(entry));
+            goto done;
+        }
+        if (entry->bufferFrames && (entry->bufferFrames < entry->info->bufferRange.mMinimum
+                                    || entry->bufferFrames > entry->info->bufferRange.mMaximum)) {
+            fprintf(err, "Scene \"%s\": a %u-frame buffer is outside the range of \"%s\".\n", sceneName,
+                    (unsigned)entry->bufferFrames, sceneDeviceName(entry));
+            goto done;
+        }
+    }
+
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        SceneRole *entry = &roles[role];
+        if (!entry->present) {
+            continue;
+        }
+        // A device shared by two roles is configured once.
+        if (entry->rate && entry->info->sampleRate == entry->rate) {
+            entry->rate = 0;
+        }
+        for (int prior = 0; prior < role; prior++) {
+            if (roles[prior].present && roles[prior].info->id == entry->info->id
+                && roles[prior].bufferFrames == entry->bufferFrames) {
+                entry->bufferFrames = 0;
+            }
+        }
+        if (entry->rate) {
+            Float64 previous = getNominalSampleRate(entry->info->id);
+            if (!setDeviceRate(entry->info, sceneDeviceName(entry), entry->rate, err)) {
+                goto rollback;
+            }
+            if (previous > 0) {
+                undo[undoCount++] = (SceneUndo){ SCENE_UNDO_RATE, (DeviceRole)role, entry, .previous.rate = previous };
+            }
+        }
+        if (entry->bufferFrames) {
+            UInt32 previous = getDeviceFrames(entry->info->id, kAudioDevicePropertyBufferFrameSize,
+                                              kAudioObjectPropertyScopeGlobal);
+            if (!setDeviceBufferFrames(entry->info, sceneDeviceName(entry), entry->bufferFrames, err)) {
+                goto rollback;
+            }
+            if (previous) {
+                undo[undoCount++] = (SceneUndo){ SCENE_UNDO_BUFFER, (DeviceRole)role, entry,
+                                                 .previous.frames = previous };
+            }
+        }
+    }
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        SceneRole *entry = &roles[role];
+        if (!entry->present || entry->volume < 0) {
+            continue;
+        }
+        Float32 previous;
+        bool known = getDeviceVolume(entry->info->id, roleScope((DeviceRole)role), &previous);
+        if (setDeviceVolume(entry->info->id, roleScope((DeviceRole)role), entry->channels,
+                            (Float32)entry->volume / 100.0f) != noErr) {
+            fprintf(err, "\"%s\" has no adjustable %s volume.\n", sceneDeviceName(entry), roleNames[role]);
+            goto rollback;
+        }
+        if (known) {
+            undo[undoCount++] = (SceneUndo){ SCENE_UNDO_VOLUME, (DeviceRole)role, entry, .previous.volume = previous };
+        }
+    }
+
+    static const DeviceRole order[] = { ROLE_INPUT, ROLE_SYSTEM, ROLE_OUTPUT };
+    double confirmMs = -1;
+    CommandOptions retryOnly = *options;
+    retryOnly.waitForSwitch = false;
+    for (size_t i = 0; i < sizeof(order) / sizeof(order[0]); i++) {
+        DeviceRole role = order[i];
+        SceneRole *entry = &roles[role];
+        if (!entry->present || (snap && snap->defaults[role] == entry->info->id)) {
+            continue;
+        }
+        AudioDeviceID previous = snap ? snap->defaults[role] : getCurrentDefaultDevice(role);
+        SceneUndo change = { SCENE_UNDO_DEFAULT, role, entry, .previous.device = previous };
+        OSStatus status = switchDefaultDevice(role, entry->info->id, role == ROLE_OUTPUT ? options : &retryOnly,
+                                              &confirmMs);
+        if (status != noErr) {
+            printSwitchError(status, role, entry->info, options, err);
+            // A timed-out switch may still land late; undo it too.
+            if (status == kSwitchTimedOutError) {
+                undo[undoCount++] = change;
+            }
+            goto rollback;
+        }
+        undo[undoCount++] = change;
+        if (snap) {
+            snap->defaults[role] = entry->info->id;
+        }
+    }
+
+    fprintf(out, "Applied scene \"%s\":", sceneName);
+    const char *separator = " ";
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        if (roles[role].present) {
+            fprintf(out, "%s%s \"%s\"", separator, roleNames[role], sceneDeviceName(&roles[role]));
+            separator = ", ";
+        }
+    }
+    fputs(".\n", out);
+    printConfirmation(confirmMs, out);
+    result = 0;
+    goto done;
+
+rollback:
+    if (undoCount > 0 && undoScene(snap, undo, undoCount, err)) {
+        fprintf(err, "Scene \"%s\" was rolled back.\n", sceneName);
+    }
+
+done:
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        free(roles[role].fetchedName);
+    }
+    freeArena(&scratch);
+    free(text);
+    return result;
+}
+
+// Quotes a UID the way splitCommandLine reads it back.
+static void writeSceneUID(FILE *out, const char *uid) {
+    fputc('"', out);
+    for (const char *p = uid; *p; p++) {
+        if (*p == '"' || *p == '\\') {
+            fputc('\\', out);
+        }
+        fputc(*p, out);
+    }
+    fputc('"', out);
+}
+
+static void writeSceneDefinition(const DeviceSnapshot *snap, FILE *out) {
+    const char *separator = "";
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        const DeviceInfo *info = findSnapshotDevice(snap, snap->defaults[role]);
+        if (!info || !info->uid) {
+            continue;
+        }
+        fprintf(out, "%s%s ", separator, role == ROLE_SYSTEM ? "system" : roleNames[role]);
+        writeSceneUID(out, info->uid);
+        separator = "; ";
+        // The alert device shares its hardware settings with whatever else
+        // plays through it; only the main roles carry them.
+        if (role == ROLE_SYSTEM) {
+            continue;
+        }
+        Float32 volume;
+        if (getDeviceVolume(info->id, roleScope((DeviceRole)role), &volume)) {
+            fprintf(out, " volume %.0f", volume * 100.0f);
+        }
+        if (role == ROLE_INPUT && info->id == snap->defaults[ROLE_OUTPUT]) {
+            continue;
+        }
+        Float64 rate = getNominalSampleRate(info->id);
+        if (rate > 0) {
+            fprintf(out, " rate %.0f", rate);
+        }
+        UInt32 frames = getDeviceFrames(info->id, kAudioDevicePropertyBufferFrameSize,
+                                        kAudioObjectPropertyScopeGlobal);
+        if (frames) {
+            fprintf(out, " buffer %u", (unsigned)frames);
+        }
+    }
+}
+
+// Creates the missing directories above path, like mkdir -p.
+static void createParentDirectories(char *path) {
+    for (char *slash = strchr(path + 1, '/'); slash; slash = strchr(slash + 1, '/')) {
+        *slash = '\0';
+        mkdir(path, 0755);
+        *slash = '/';
+    }
+}
+
+// Rewrites the scenes file with NAME's line replaced or appended; every other
+// line, comments included, is kept as it was.
+static int saveScene(const DeviceSnapshot *snap, const char *sceneName, FILE *out, FILE *err) {
+    if (!*sceneName || strpbrk(sceneName, "=#\n")) {
+        fprintf(err, "Scene names may not be empty or contain '=', '#' or newlines.\n");
+        return 1;
+    }
+    char path[1024], tmpPath[1100];
+    if (!getConfigPath(&sceneTable, path, sizeof(path))) {
+        fprintf(err, "Cannot locate the scenes file.\n");
+        return 1;
+    }
+    snprintf(tmpPath, sizeof(tmpPath), "%s.%d", path, (int)getpid());
+
+    char keyBuf[256];
+    char *key = normalizeName(sceneName, keyBuf, sizeof(keyBuf));
+    if (!key) {
+        return 1;
+    }
+    createParentDirectories(path);
+    FILE *dst = fopen(tmpPath, "w");
+    if (!dst) {
+        fprintf(err, "Cannot write %s: %s\n", tmpPath, strerror(errno));
+        if (key != keyBuf) {
+            free(key);
+        }
+        return 1;
+    }
+
+    FILE *src = fopen(path, "r");
+    if (src) {
+        char *line = NULL;
+        size_t lineCap = 0;
+        ssize_t lineLen;
+        while ((lineLen = getline(&line, &lineCap, src)) > 0) {
+            const char *eq = strchr(line, '=');
+            const char *start = line, *end = eq;
+            char nameBuf[256];
+            bool replaced = false;
+            if (eq && !memchr(line, '#', (size_t)(eq - line))) {
+                trimSpan(&start, &end);
+                size_t nameLen = (size_t)(end - start);
+                if (nameLen < sizeof(nameBuf)) {
+                    memcpy(nameBuf, start, nameLen);
+                    nameBuf[nameLen] = '\0';
+                    normalizeNameInto(nameBuf, nameBuf);
+                    replaced = strcmp(nameBuf, key) == 0;
+                }
+            }
+            if (!replaced) {
+                fputs(line, dst);
+                if (line[lineLen - 1] != '\n') {
+                    fputc('\n', dst);
+                }
+            }
+        }
+        free(line);
+        fclose(src);
+    }
+    fprintf(dst, "%s = ", sceneName);
+    writeSceneDefinition(snap, dst);
+    fputc('\n', dst);
+
+    bool ok = fclose(dst) == 0 && rename(tmpPath, path) == 0;
+    if (key != keyBuf) {
+        free(key);
+    }
+    if (!ok) {
+        fprintf(err, "Cannot write %s: %s\n", path, strerror(errno));
+        unlink(tmpPath);
+        return 1;
+    }
+    fprintf(out, "Saved scene \"%s\" to %s.\n", sceneName, path);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Actions
+//
+// A command line is a sequence of actions that run in order against one
+// snapshot, so "switch_audio -l Speakers -l" enumerates devices once. The
+// whole line is parsed before anything runs; a typo never leaves a
+// half-applied chain behind.
+// ---------------------------------------------------------------------------
+
+typedef enum {
+    ACTION_LIST,
+    ACTION_NEXT,
+    ACTION_SWITCH,
+    ACTION_SWITCH_ALL,
+    ACTION_SWITCH_UID,
+    ACTION_VOLUME,
+    ACTION_MUTE,
+    ACTION_UNMUTE,
+    ACTION_RATE,
+    ACTION_BUFFER,
+    ACTION_LATENCY,
+    ACTION_AGGREGATE,
+    ACTION_TEARDOWN,
+    ACTION_SCENE,
+    ACTION_SAVE_SCENE,
+    ACTION_STATS,
+    ACTION_HELP
+} ActionKind;
+
+typedef struct {
+    ActionKind kind;
+    DeviceRole role;    // -t in effect where the action appeared
+    const char *arg;
+} Action;
+
+// Parses a whole --wait/--timeout style millisecond value.
+static bool parseMilliseconds(const char *arg, long *value) {
+    char *end;
+    long ms = strtol(arg, &end, 10);
+    if (*arg == '\0' || *end != '\0' || ms < 0 || ms > 600000) {
+        return false;
+    }
+    *value = ms;
+    return true;
+}
+
+// Parses argv[1..argc) into actions, which must have room for argc entries.
+// Options such as --wait apply to every action on the line.
+static bool parseActions(int argc, char* argv[], Action *actions, int *actionCount,
+                         CommandOptions *options, FILE *err) {
+    options->waitForSwitch = false;
+    options->waitTimeoutMs = DEFAULT_WAIT_TIMEOUT_MS;
+    options->retries = 0;
+    options->backoffMs = DEFAULT_RETRY_BACKOFF_MS;
+    options->format = FORMAT_TEXT;
+    options->role = ROLE_OUTPUT;
+    options->rotationSet = NULL;
+    options->aggregateName = NULL;
+    options->filter = (TransportFilter){ .allowedCount = 0 };
+
+    int count = 0;
+    for (int i = 1; i < argc; i++) {
+        const char *arg = argv[i];
+        Action *action = &actions[count];
+        action->arg = NULL;
+        action->role = options->role;
+
+        if (strcmp(arg, "-w") == 0 || strcmp(arg, "--wait") == 0) {
+            options->waitForSwitch = true;
+            continue;
+        }
+        if (strcmp(arg, "--timeout") == 0) {
+            if (i + 1 >= argc || !parseMilliseconds(argv[i + 1], &options->waitTimeoutMs)) {
+                fprintf(err, "Error: --timeout needs a duration in milliseconds.\n");
+                return false;
+            }
+            options->waitForSwitch = true;
+            i++;
+            continue;
+        }
+        if (strcmp(arg, "--retry") == 0) {
+            char *end;
+            options->retries = i + 1 < argc ? strtol(argv[i + 1], &end, 10) : -1;
+            if (i + 1 >= argc || !*argv[i + 1] || *end != '\0' || options->retries < 0
+                || options->retries > MAX_RETRIES) {
+                fprintf(err, "Error: --retry needs a count between 0 and %d.\n", MAX_RETRIES);
+                return false;
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(arg, "--backoff") == 0) {
+            if (i + 1 >= argc || !parseMilliseconds(argv[i + 1], &options->backoffMs) || options->backoffMs == 0) {
+                fprintf(err, "Error: --backoff needs a duration in milliseconds.\n");
+                return false;
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(arg, "-t") == 0 || strcmp(arg, "--type") == 0) {
+            if (i + 1 >= argc || !parseDeviceRole(argv[i + 1], &options->role)) {
+                fprintf(err, "Error: -t must be output, input or system.\n");
+                return false;
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(arg, "--set") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(err, "Error: --set needs a rotation set name.\n");
+                return false;
+            }
+            options->rotationSet = argv[++i];
+            continue;
+        }
+        if (strcmp(arg, "--only") == 0) {
+            if (i + 1 >= argc || !parseTransportList(argv[i + 1], &options->filter)) {
+                fprintf(err, "Error: --only needs a list of transports such as builtin,usb,bluetooth,hdmi.\n");
+                return false;
+            }
+            i++;
+            continue;
+        }
+        if (strcmp(arg, "--hide-virtual") == 0) {
+            options->filter.hideVirtual = true;
+            continue;
+        }
+        if (strcmp(arg, "--name") == 0) {
+            if (i + 1 >= argc || !*argv[i + 1]) {
+                fprintf(err, "Error: --name needs a device name.\n");
+                return false;
+            }
+            options->aggregateName = argv[++i];
+            continue;
+        }
+        if (strcmp(arg, "--format") == 0) {
+            if (i + 1 >= argc || !parseOutputFormat(argv[i + 1], &options->format)) {
+                fprintf(err, "Error: --format must be text, json, tsv or nul.\n");
+                return false;
+            }
+            i++;
+            continue;
+        }
+
+        if (strcmp(arg, "-l") == 0 || strcmp(arg, "--list") == 0) {
+            action->kind = ACTION_LIST;
+        } else if (strcmp(arg, "--latency") == 0) {
+            action->kind = ACTION_LATENCY;
+        } else if (strcmp(arg, "-n") == 0 || strcmp(arg, "--next") == 0) {
+            action->kind = ACTION_NEXT;
+        } else if (strcmp(arg, "-h") == 0 || strcmp(arg, "--help") == 0) {
+            action->kind = ACTION_HELP;
+        } else if (strcmp(arg, "--stats") == 0) {
+            action->kind = ACTION_STATS;
+        } else if (strcmp(arg, "--uid") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(err, "Error: --uid needs a device UID or alias.\n");
+                return false;
+            }
+            action->kind = ACTION_SWITCH_UID;
+            action->arg = argv[++i];
+        } else if (strcmp(arg, "--volume") == 0) {
+            long percent;
+            bool relative;
+            if (i + 1 >= argc || !parseVolume(argv[i + 1], &percent, &relative) || (!relative && percent < 0)) {
+                fprintf(err, "Error: --volume needs a percentage (0-100) or a step such as +10 or -10.\n");
+                return false;
+            }
+            action->kind = ACTION_VOLUME;
+            action->arg = argv[++i];
+        } else if (strcmp(arg, "--rate") == 0) {
+            Float64 rate;
+            if (i + 1 >= argc || !parseSampleRate(argv[i + 1], &rate)) {
+                fprintf(err, "Error: --rate needs a sample rate in Hz, such as 48000.\n");
+                return false;
+            }
+            action->kind = ACTION_RATE;
+            action->arg = argv[++i];
+        } else if (strcmp(arg, "--buffer") == 0) {
+            UInt32 frames;
+            if (i + 1 >= argc || !parseBufferFrames(argv[i + 1], &frames)) {
+                fprintf(err, "Error: --buffer needs a buffer size in frames, such as 64.\n");
+                return false;
+            }
+            action->kind = ACTION_BUFFER;
+            action->arg = argv[++i];
+        } else if (strcmp(arg, "--mute") == 0) {
+            action->kind = ACTION_MUTE;
+        } else if (strcmp(arg, "--unmute") == 0) {
+            action->kind = ACTION_UNMUTE;
+        } else if (strcmp(arg, "--aggregate") == 0 || strcmp(arg, "--teardown") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(err, "Error: %s needs %s.\n", arg,
+                        arg[2] == 'a' ? "a comma-separated list of devices" : "an aggregate name");
+                return false;
+            }
+            action->kind = arg[2] == 'a' ? ACTION_AGGREGATE : ACTION_TEARDOWN;
+            action->arg = argv[++i];
+        } else if (strcmp(arg, "--scene") == 0 || strcmp(arg, "--save-scene") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(err, "Error: %s needs a scene name.\n", arg);
+                return false;
+            }
+            action->kind = arg[3] == 'c' ? ACTION_SCENE : ACTION_SAVE_SCENE;
+            action->arg = argv[++i];
+        } else if (strcmp(arg, "--all") == 0) {
+            if (i + 1 >= argc) {
+                fprintf(err, "Error: --all needs a device name.\n");
+                return false;
+            }
+            action->kind = ACTION_SWITCH_ALL;
+            action->arg = argv[++i];
+        } else {
+            // Two bare names in a row are almost always an unquoted name.
+            if (count > 0 && actions[count - 1].kind == ACTION_SWITCH && actions[count - 1].role == options->role) {
+                fprintf(err, "Error: Please provide exactly one device name.\n\n");
+                printUsage(argv[0], err);
+                return false;
+            }
+            action->kind = ACTION_SWITCH;
+            action->arg = arg;
+        }
+        count++;
+    }
+
+    *actionCount = count;
+    return true;
+}
+
+// Runs actions in order and stops at the first one that fails.
+static int runActions(DeviceSnapshot *snap, const char *progName, const Action *actions, int actionCount,
+                      const CommandOptions *options, FILE *out, FILE *err) {
+    for (int i = 0; i < actionCount; i++) {
+        CommandOptions actionOptions = *options;
+        actionOptions.role = actions[i].role;
+        int status = 0;
+        switch (actions[i].kind) {
+        case ACTION_LIST:
+            listAudioDevices(snap, actionOptions.role, options->format, out);
+            break;
+        case ACTION_AGGREGATE:
+            status = buildAggregate(snap, actions[i].arg, progName, &actionOptions, out, err);
+            break;
+        case ACTION_TEARDOWN:
+            status = teardownAggregate(snap, actions[i].arg, progName, out, err);
+            break;
+        case ACTION_SCENE:
+            status = applyScene(snap, actions[i].arg, &actionOptions, out, err);
+            break;
+        case ACTION_SAVE_SCENE:
+            status = saveScene(snap, actions[i].arg, out, err);
+            break;
+        case ACTION_LATENCY:
+            reportLatencies(snap, actionOptions.role, options->format, out);
+            break;
+        case ACTION_NEXT:
+            status = switchToNextDevice(snap, &actionOptions, out, err);
+            break;
+        case ACTION_SWITCH:
+            status = switchToNamedDevice(snap, actions[i].arg, progName, &actionOptions, out, err);
+            break;
+        case ACTION_SWITCH_ALL:
+            status = switchAllRoles(snap, actions[i].arg, progName, &actionOptions, out, err);
+            break;
+        case ACTION_SWITCH_UID:
+            status = switchByUID(snap, actions[i].arg, &actionOptions, out, err);
+            break;
+        case ACTION_VOLUME:
+        case ACTION_MUTE:
+        case ACTION_UNMUTE:
+            status = changeDeviceVolume(snap, actions[i].arg, actions[i].kind == ACTION_MUTE,
+                                        &actionOptions, out, err);
+            break;
+        case ACTION_RATE:
+        case ACTION_BUFFER:
+            status = changeDeviceFormat(snap, actions[i].kind == ACTION_RATE ? actions[i].arg : NULL,
+                                        actions[i].kind == ACTION_BUFFER ? actions[i].arg : NULL,
+                                        &actionOptions, out, err);
+            break;
+        case ACTION_STATS:
+            if (!metricsEnabled) {
+                fprintf(err, "--stats reports a running daemon's metrics; start one with %s --daemon.\n", progName);
+                status = 1;
+            } else {
+                writeMetrics(out);
+            }
+            break;
+        case ACTION_HELP:
+            printUsage(progName, out);
+            break;
+        }
+        if (status != 0) {
+            return status;
+        }
+    }
+    return 0;
+}
+
+// Only --uid switches, scenes, volume and format changes, --stats and help
+// can run without enumerating devices.
+static bool actionsNeedSnapshot(const Action *actions, int actionCount) {
+    for (int i = 0; i < actionCount; i++) {
+        switch (actions[i].kind) {
+        case ACTION_SWITCH_UID:
+        case ACTION_SCENE:
+        case ACTION_VOLUME:
+        case ACTION_MUTE:
+        case ACTION_UNMUTE:
+        case ACTION_RATE:
+        case ACTION_BUFFER:
+        case ACTION_STATS:
+        case ACTION_HELP:
+            break;
+        default:
+            return true;
+        }
+    }
+    return false;
+}
+
+// Runs one command line against a snapshot. Shared by the one-shot CLI path,
+// batch mode and the daemon, which passes its long-lived snapshot and
+// captured streams. With a NULL snap, one is acquired only if some action
+// needs it.
+static int runCommand(DeviceSnapshot *snap, int argc, char* argv[], FILE *out, FILE *err) {
+    Action *actions = tracedMalloc((size_t)argc * sizeof(Action));
+    if (!actions) {
+        return 1;
+    }
+
+    int actionCount;
+    CommandOptions options;
+    int status = 1;
+    if (parseActions(argc, argv, actions, &actionCount, &options, err)) {
+        DeviceSnapshot local;
+        bool ownSnapshot = !snap && actionsNeedSnapshot(actions, actionCount);
+        if (ownSnapshot && acquireDeviceSnapshot(&local, &options.filter) != noErr) {
+            fprintf(err, "Error getting device list\n");
+            free(actions);
+            return 1;
+        }
+        DeviceSnapshot *target = ownSnapshot ? &local : snap;
+        if (target) {
+            applyTransportFilter(target, &options.filter);
+        }
+
+        os_signpost_id_t signpost = traceSignpostID();
+        TRACE_BEGIN(signpost, "command", "%d actions", actionCount);
+        status = runActions(target, argv[0], actions, actionCount, &options, out, err);
+        TRACE_END(signpost, "command", "status %d", status);
+
+        if (ownSnapshot) {
+            // A freshly resolved rotation set goes into the disk cache for
+            // the next one-shot -n --set; one resolved under a filter is not.
+            if (local.cycleChanged && !local.filtered && cacheEnabled()) {
+                saveCachedSnapshot(&local);
+            }
+            freeDeviceSnapshot(&local);
+        } else if (target) {
+            applyTransportFilter(target, NULL);
+        }
+    }
+
+    free(actions);
+    return status;
+}
+
+// Splits a batch line into words in place. Supports single quotes, double
+// quotes and backslash escapes; an unquoted '#' starts a comment. Returns
+// the word count, or -1 on an unterminated quote.
+static int splitCommandLine(char *line, char **words, int maxWords) {
+    int count = 0;
+    char *src = line;
+
+    for (;;) {
+        while (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n') {
+            src++;
+        }
+        if (!*src || *src == '#') {
+            return count;
+        }
+        if (count == maxWords) {
+            return -1;
+        }
+
+        char *dst = src;
+        words[count++] = dst;
+        char quote = '\0';
+        for (; *src; src++) {
+            if (quote) {
+                if (*src == quote) {
+                    quote = '\0';
+                    continue;
+                }
+                if (*src == '\\' && quote == '"' && src[1]) {
+                    src++;
+                }
+            } else if (*src == '\'' || *src == '"') {
+                quote = *src;
+                continue;
+            } else if (*src == '\\' && src[1]) {
+                src++;
+            } else if (*src == ' ' || *src == '\t' || *src == '\r' || *src == '\n') {
+                break;
+            }
+            *dst++ = *src;
+        }
+        if (quote) {
+            return -1;
+        }
+        bool atEnd = *src == '\0';
+        *dst = '\0';
+        if (atEnd) {
+            return count;
+        }
+        src++;
+    }
+}
+
+// Rejoins an unquoted fallback chain ("AirPods || Speakers" split into three
+// words) into the one word parseActions expects. Words sit in order in the
+// buffer splitCommandLine wrote them to, each ending before the next begins,
+// so a joined word always fits where its parts were. Returns the new count.
+static int joinFallbackWords(char **words, int count) {
+    int kept = 0;
+    for (int i = 0; i < count; i++) {
+        if (kept > 0) {
+            char *prev = words[kept - 1];
+            size_t prevLen = strlen(prev);
+            bool chained = (prevLen >= 2 && strcmp(prev + prevLen - 2, "||") == 0)
+                || strncmp(words[i], "||", 2) == 0;
+            if (chained) {
+                prev[prevLen] = ' ';
+                memmove(prev + prevLen + 1, words[i], strlen(words[i]) + 1);
+                continue;
+            }
+        }
+        words[kept++] = words[i];
+    }
+    return kept;
+}
+
+#define BATCH_MAX_WORDS 64
+
+// Reads one command line per input line and runs each against the same
+// snapshot. Blank lines and '#' comments are skipped; the first failing line
+// stops the batch.
+static int runBatch(DeviceSnapshot *snap, const char *progName, const char *path, FILE *out, FILE *err) {
+    FILE *in = stdin;
+    if (path && strcmp(path, "-") != 0) {
+        in = fopen(path, "r");
+        if (!in) {
+            fprintf(err, "%s: %s\n", path, strerror(errno));
+            return 1;
+        }
+    }
+
+    char *line = NULL;
+    size_t lineCap = 0;
+    int lineNumber = 0;
+    int status = 0;
+    char *words[BATCH_MAX_WORDS + 1];
+
+    while (status == 0 && getline(&line, &lineCap, in) >= 0) {
+        lineNumber++;
+        words[0] = (char *)progName;
+        int wordCount = splitCommandLine(line, &words[1], BATCH_MAX_WORDS);
+        if (wordCount > 0) {
+            wordCount = joinFallbackWords(&words[1], wordCount);
+        }
+        if (wordCount < 0) {
+            fprintf(err, "Line %d: unterminated quote or too many words\n", lineNumber);
+            status = 1;
+        } else if (wordCount > 0) {
+            status = runCommand(snap, wordCount + 1, words, out, err);
+            if (status != 0) {
+                fprintf(err, "Batch stopped at line %d\n", lineNumber);
+            }
+        }
+    }
+
+    free(line);
+    if (in != stdin) {
+        fclose(in);
+    }
+    return status;
+}
+
+// ---------------------------------------------------------------------------
+// Preference rules
+//
+// A priority list such as "AirPods Pro > Studio Display > MacBook Pro
+// Speakers" is re-evaluated whenever a long-running mode sees the device list
+// change: the first entry that is present and responding becomes the default
+// output. Entries are normalized and hashed once, so each evaluation is a
+// handful of index probes against the snapshot. They match a full name (case
+// and whitespace folded) or a UID; word prefixes are not considered, because
+// what a prefix means changes as devices come and go.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    char *name;
+    char *matchName;
+    UInt32 nameHash;
+    UInt32 uidHash;
+} PreferenceRule;
+
+typedef struct {
+    PreferenceRule *rules;
+    UInt32 count;
+} PreferenceList;
+
+static PreferenceList preferences;
+
+static bool addPreferenceRule(PreferenceList *list, const char *start, size_t len) {
+    while (len && (*start == ' ' || *start == '\t')) {
+        start++;
+        len--;
+    }
+    while (len && (start[len - 1] == ' ' || start[len - 1] == '\t')) {
+        len--;
+    }
+    if (!len) {
+        return false;
+    }
+
+    PreferenceRule *grown = realloc(list->rules, (list->count + 1) * sizeof(PreferenceRule));
+    if (!grown) {
+        return false;
+    }
+    list->rules = grown;
+
+    PreferenceRule *rule = &list->rules[list->count];
+    rule->name = tracedMalloc(len + 1);
+    if (!rule->name) {
+        return false;
+    }
+    memcpy(rule->name, start, len);
+    rule->name[len] = '\0';
+    rule->matchName = normalizeName(rule->name, NULL, 0);
+    if (!rule->matchName) {
+        free(rule->name);
+        return false;
+    }
+    rule->nameHash = hashString(rule->matchName);
+    rule->uidHash = hashString(rule->name);
+    list->count++;
+    return true;
+}
+
+// Parses "A > B > C". Empty entries are rejected so a stray '>' is reported
+// rather than silently dropped.
+static bool parsePreferenceList(const char *spec, PreferenceList *list, FILE *err) {
+    const char *start = spec;
+    for (;;) {
+        const char *sep = strchr(start, '>');
+        size_t len = sep ? (size_t)(sep - start) : strlen(start);
+        if (!addPreferenceRule(list, start, len)) {
+            fprintf(err, "Error: invalid preference list \"%s\" (expected \"A > B > C\").\n", spec);
+            return false;
+        }
+        if (!sep) {
+            return true;
+        }
+        start = sep + 1;
+    }
+}
+
+static const DeviceInfo* resolvePreferenceRule(const DeviceSnapshot *snap, const PreferenceRule *rule) {
+    const char *aliasUID = lookupAlias(rule->name);
+    if (aliasUID) {
+        const DeviceInfo *info = findDeviceByUID(snap, ROLE_OUTPUT, aliasUID);
+        return info && !info->unresponsive ? info : NULL;
+    }
+
+    const DeviceInfo *found = NULL;
+    for (UInt32 slot = rule->nameHash & snap->byName.mask; snap->byName.slots[slot];
+         slot = (slot + 1) & snap->byName.mask) {
+        const DeviceInfo *info = &snap->devices[snap->byName.slots[slot] - 1];
+        if (info->hasOutput && !info->unresponsive && info->nameHash == rule->nameHash
+            && strcmp(info->matchName, rule->matchName) == 0 && (!found || info < found)) {
+            found = info;
+        }
+    }
+    if (found) {
+        return found;
+    }
+
+    for (UInt32 slot = rule->uidHash & snap->byUID.mask; snap->byUID.slots[slot];
+         slot = (slot + 1) & snap->byUID.mask) {
+        const DeviceInfo *info = &snap->devices[snap->byUID.slots[slot] - 1];
+        if (info->hasOutput && !info->unresponsive && info->uidHash == rule->uidHash
+            && strcmp(info->uid, rule->name) == 0) {
+            return info;
+        }
+    }
+    return NULL;
+}
+
+// Switches to the highest-ranked available device. Nothing happens when the
+// winner is already the default, so a manual switch sticks until the next
+// hotplug event.
+// Runs from HAL notifications on the watch or daemon run loop, so it takes no
+// --retry: waiting there would hold up every request. A failed switch is
+// tried again on the next device-list change.
+static void applyPreferences(DeviceSnapshot *snap) {
+    for (UInt32 i = 0; i < preferences.count; i++) {
+        const DeviceInfo *info = resolvePreferenceRule(snap, &preferences.rules[i]);
+        if (!info) {
+            continue;
+        }
+        if (info->id != snap->defaults[ROLE_OUTPUT]) {
+            OSStatus status = setDefaultDevice(ROLE_OUTPUT, info->id);
+            if (status == noErr) {
+                snap->defaults[ROLE_OUTPUT] = info->id;
+                fprintf(stderr, "Preferred device available, switched to: %s\n", info->name);
+            } else {
+                fprintf(stderr, "Failed to switch to preferred device %s (error %d)\n", info->name, (int)status);
+            }
+        }
+        return;
+    }
+}
+
+// --prefer on the command line wins over SWITCH_AUDIO_PREFER.
+static bool loadPreferences(const char *spec, FILE *err) {
+    if (!spec) {
+        spec = getenv("SWITCH_AUDIO_PREFER");
+    }
+    if (!spec || !*spec) {
+        return true;
+    }
+    return parsePreferenceList(spec, &preferences, err);
+}
+
+// ---------------------------------------------------------------------------
+// Watch mode
+//
+// --watch prints one line per default-device change or hotplug event, driven
+// by HAL property listeners on this thread's run loop. The current defaults
+// are printed first so a consumer starts from a known state.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    DeviceSnapshot snap;
+    OutputFormat format;
+} WatchState;
+
+static const char *const watchEventNames[ROLE_COUNT] = {
+    "default-output", "default-input", "default-system"
+};
+
+// A device the snapshot knows nothing about (it timed out, or the default
+// moved before the device-list notification arrived) is looked up on the
+// spot. Removed devices can no longer be asked.
+static void emitWatchEvent(const WatchState *watch, const char *event, AudioDeviceID deviceID,
+                           const DeviceInfo *known, bool askHAL) {
+    const char *name = known ? known->name : NULL;
+    const char *uid = known ? known->uid : NULL;
+    char *fetchedName = NULL, *fetchedUID = NULL;
+    if (askHAL && deviceID != kAudioObjectUnknown && !name) {
+        name = fetchedName = getDeviceName(deviceID);
+        // Text lines never show the UID, so don't fetch it for them.
+        if (watch->format == FORMAT_JSON) {
+            uid = fetchedUID = getDeviceUID(deviceID);
+        }
+    }
+
+    if (watch->format == FORMAT_JSON) {
+        struct timeval now;
+        gettimeofday(&now, NULL);
+        fprintf(stdout, "{\"event\":\"%s\",\"time\":%ld.%03d,\"id\":%u", event,
+                (long)now.tv_sec, (int)(now.tv_usec / 1000), (unsigned)deviceID);
+        if (uid) {
+            fputs(",\"uid\":", stdout);
+            writeJSONString(stdout, uid);
+        }
+        if (name) {
+            fputs(",\"name\":", stdout);
+            writeJSONString(stdout, name);
+        }
+        fputs("}\n", stdout);
+    } else if (name) {
+        fprintf(stdout, "%s: %s\n", event, name);
+    } else if (deviceID == kAudioObjectUnknown) {
+        fprintf(stdout, "%s: none\n", event);
+    } else {
+        fprintf(stdout, "%s: device %u\n", event, (unsigned)deviceID);
+    }
+    fflush(stdout);
+
+    free(fetchedName);
+    free(fetchedUID);
+}
+
+static void watchDeviceListChanged(WatchState *watch) {
+    DeviceSnapshot fresh;
+    if (buildDeviceSnapshot(&fresh) != noErr) {
+        return;
+    }
+
+    for (UInt32 i = 0; i < watch->snap.count; i++) {
+        const DeviceInfo *old = &watch->snap.devices[i];
+        if (!findSnapshotDevice(&fresh, old->id)) {
+            emitWatchEvent(watch, "removed", old->id, old, false);
+        }
+    }
+    for (UInt32 i = 0; i < fresh.count; i++) {
+        const DeviceInfo *info = &fresh.devices[i];
+        if (!findSnapshotDevice(&watch->snap, info->id)) {
+            emitWatchEvent(watch, "added", info->id, info->unresponsive ? NULL : info, !info->unresponsive);
+        }
+    }
+
+    applyPreferences(&fresh);
+
+    // Defaults are tracked separately through their own listeners.
+    memcpy(fresh.defaults, watch->snap.defaults, sizeof(fresh.defaults));
+    freeDeviceSnapshot(&watch->snap);
+    watch->snap = fresh;
+}
+
+static OSStatus onWatchedPropertyChanged(AudioObjectID objectID, UInt32 addressCount,
+                                         const AudioObjectPropertyAddress *addresses, void *clientData) {
+    (void)objectID;
+    WatchState *watch = clientData;
+
+    for (UInt32 i = 0; i < addressCount; i++) {
+        if (addresses[i].mSelector == kAudioHardwarePropertyDevices) {
+            watchDeviceListChanged(watch);
+            continue;
+        }
+        for (int role = 0; role < ROLE_COUNT; role++) {
+            if (addresses[i].mSelector != roleSelectors[role]) {
+                continue;
+            }
+            AudioDeviceID current = getCurrentDefaultDevice((DeviceRole)role);
+            if (current != watch->snap.defaults[role]) {
+                watch->snap.defaults[role] = current;
+                emitWatchEvent(watch, watchEventNames[role], current,
+                               findSnapshotDevice(&watch->snap, current), true);
+            }
+        }
+    }
+    return noErr;
+}
+
+static int runWatch(int argc, char* argv[]) {
+    static WatchState watch;
+    watch.format = FORMAT_TEXT;
+    const char *preferSpec = NULL;
+
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--json") == 0) {
+            watch.format = FORMAT_JSON;
+        } else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc
+                   && parseOutputFormat(argv[i + 1], &watch.format)
+                   && (watch.format == FORMAT_TEXT || watch.format == FORMAT_JSON)) {
+            i++;
+        } else if (strcmp(argv[i], "--prefer") == 0 && i + 1 < argc) {
+            preferSpec = argv[++i];
+        } else {
+            fprintf(stderr, "Error: --watch only accepts --format text|json and --prefer LIST.\n");
+            return 1;
+        }
+    }
+    if (!loadPreferences(preferSpec, stderr)) {
+        return 1;
+    }
+
+    if (buildDeviceSnapshot(&watch.snap) != noErr) {
+        fprintf(stderr, "Error getting device list\n");
+        return 1;
+    }
+
+    setHALNotificationRunLoop(CFRunLoopGetCurrent());
+
+    AudioObjectPropertyAddress watched[] = {
+        { kAudioHardwarePropertyDevices, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioHardwarePropertyDefaultOutputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioHardwarePropertyDefaultInputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioHardwarePropertyDefaultSystemOutputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+    };
+    for (size_t i = 0; i < sizeof(watched) / sizeof(watched[0]); i++) {
+        if (AudioObjectAddPropertyListener(kAudioObjectSystemObject, &watched[i],
+                                           onWatchedPropertyChanged, &watch) != noErr) {
+            fprintf(stderr, "Failed to register HAL property listener\n");
+            return 1;
+        }
+    }
+
+    AudioDeviceID initialOutput = watch.snap.defaults[ROLE_OUTPUT];
+    applyPreferences(&watch.snap);
+    // Report the state we started from; a preference switch follows as an event.
+    watch.snap.defaults[ROLE_OUTPUT] = initialOutput;
+    for (int role = 0; role < ROLE_COUNT; role++) {
+        AudioDeviceID current = watch.snap.defaults[role];
+        emitWatchEvent(&watch, watchEventNames[role], current, findSnapshotDevice(&watch.snap, current), true);
+    }
+
+    CFRunLoopRun();
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Daemon mode
+//
+// The daemon keeps one DeviceSnapshot alive and refreshes it from HAL property
+// listeners, so a forwarded command costs one socket round-trip plus whatever
+// the command itself has to set. Requests are NUL-separated argv strings
+// terminated by EOF; the reply is a "<status> <outLen> <errLen>\n" header
+// followed by the captured stdout and stderr bytes.
+// ---------------------------------------------------------------------------
+
+#define DAEMON_MAX_REQUEST (64 * 1024)
+// The daemon answers DAEMON_ACCEPTED as soon as it has read a request, or
+// DAEMON_BUSY while another command (a hotkey bound to --wait, say) still
+// runs. A client that is refused, or hears nothing within
+// DAEMON_ACCEPT_TIMEOUT_MS, runs the command itself; the daemon drops
+// requests whose client has gone, so nothing runs twice.
+#define DAEMON_ACCEPTED '+'
+#define DAEMON_BUSY '!'
+#define DAEMON_ACCEPT_TIMEOUT_MS 2000
+#define DAEMON_REPLY_TIMEOUT_MS 30000
+
+static char daemonSocketPathBuf[sizeof(((struct sockaddr_un *)0)->sun_path)];
+
+static bool getDaemonSocketPath(char *path, size_t size) {
+    const char *override = getenv("SWITCH_AUDIO_SOCKET");
+    int n;
+    if (override && *override) {
+        n = snprintf(path, size, "%s", override);
+    } else {
+        // $TMPDIR is per-user on macOS; the uid suffix covers a shared /tmp.
+        const char *tmp = getenv("TMPDIR");
+        if (!tmp || !*tmp) {
+            tmp = "/tmp";
+        }
+        size_t len = strlen(tmp);
+        n = snprintf(path, size, "%s%sswitch_audio-%u.sock",
+                     tmp, tmp[len - 1] == '/' ? "" : "/", (unsigned)getuid());
+    }
+    return n > 0 && (size_t)n < size;
+}
+
+static bool fillSocketAddress(struct sockaddr_un *addr, const char *path) {
+    memset(addr, 0, sizeof(*addr));
+    addr->sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(addr->sun_path)) {
+        return false;
+    }
+    strcpy(addr->sun_path, path);
+    return true;
+}
+
+static int connectToDaemon(void) {
+    char path[sizeof(daemonSocketPathBuf)];
+    struct sockaddr_un addr;
+    if (!getDaemonSocketPath(path, sizeof(path)) || !fillSocketAddress(&addr, path)) {
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        return -1;
+    }
+    if (connect(fd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// Copies exactly len bytes from the socket to a local stream.
+static bool relayBytes(int fd, size_t len, FILE *dst) {
+    char buf[4096];
+    while (len > 0) {
+        ssize_t n = read(fd, buf, len < sizeof(buf) ? len : sizeof(buf));
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            return false;
+        }
+        fwrite(buf, 1, (size_t)n, dst);
+        len -= (size_t)n;
+    }
+    return true;
+}
+
+static void setReceiveTimeout(int fd, long millis) {
+    struct timeval timeout = { .tv_sec = millis / 1000, .tv_usec = (int)(millis % 1000) * 1000 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+}
+
+// Lines that wait for a device (--wait, --retry) would hold the daemon's one
+// thread, and every other client and hotkey with it, for the whole wait,
+// which dwarfs the enumeration the daemon saves. They run in-process.
+static bool commandWaits(int argc, char* argv[]) {
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-w") == 0 || strcmp(argv[i], "--wait") == 0 || strcmp(argv[i], "--retry") == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// Returns false without side effects when no daemon is listening, or when
+// the daemon refuses the request or does not take it within
+// DAEMON_ACCEPT_TIMEOUT_MS, so the caller can fall back to querying the HAL
+// itself.
+static bool forwardToDaemon(int argc, char* argv[], int *status) {
+    int fd = connectToDaemon();
+    if (fd < 0) {
+        return false;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+
+    bool ok = true;
+    for (int i = 0; i < argc && ok; i++) {
+        ok = writeAll(fd, argv[i], strlen(argv[i]) + 1);
+    }
+    shutdown(fd, SHUT_WR);
+
+    char header[64];
+    size_t headerLen = 0;
+    setReceiveTimeout(fd, DAEMON_ACCEPT_TIMEOUT_MS);
+    ssize_t n = 0;
+    while (ok && (n = read(fd, header, 1)) < 0 && errno == EINTR) {
+    }
+    if (ok && n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)) {
+        fprintf(stderr, "switch_audio daemon is not answering; running the command directly\n");
+        close(fd);
+        return false;
+    }
+    ok = ok && n == 1;
+    if (ok && header[0] == DAEMON_BUSY) {
+        fprintf(stderr, "switch_audio daemon is busy; running the command directly\n");
+        close(fd);
+        return false;
+    }
+    // A daemon from before the acknowledgement starts with the header.
+    if (ok && header[0] != DAEMON_ACCEPTED) {
+        headerLen = 1;
+    }
+    setReceiveTimeout(fd, DAEMON_REPLY_TIMEOUT_MS);
+    while (ok && headerLen < sizeof(header) - 1) {
+        ssize_t n = read(fd, &header[headerLen], 1);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            ok = false;
+        } else if (header[headerLen++] == '\n') {
+            break;
+        }
+    }
+    header[headerLen] = '\0';
+
+    int code;
+    size_t outLen, errLen;
+    if (!ok || sscanf(header, "%d %zu %zu", &code, &outLen, &errLen) != 3
+        || !relayBytes(fd, outLen, stdout) || !relayBytes(fd, errLen, stderr)) {
+        fprintf(stderr, "Lost connection to switch_audio daemon\n");
+        code = 1;
+    }
+
+    close(fd);
+    *status = code;
+    return true;
+}
+
+// A --wait or --retry command pumps the run loop while it holds pointers into
+// the snapshot, so device-list changes seen during a command are applied once
+// the outermost one returns, and socket requests and hotkeys arriving inside
+// it are turned away rather than run nested.
+static int daemonRequestDepth;
+static bool daemonRebuildPending;
+
+static void rebuildDaemonSnapshot(DeviceSnapshot *snap) {
+    DeviceSnapshot fresh;
+    // Keep serving the old snapshot if the HAL is mid-reconfiguration.
+    if (buildDeviceSnapshot(&fresh) == noErr) {
+        freeDeviceSnapshot(snap);
+        *snap = fresh;
+        atomic_fetch_add_explicit(&metrics.rebuilds, 1, memory_order_relaxed);
+        trackDeviceMetrics(snap, true);
+        saveCachedSnapshot(snap);
+        applyPreferences(snap);
+    }
+}
+
+// Runs one command line against the daemon's snapshot, for socket requests
+// and hotkeys alike.
+static int runDaemonCommand(DeviceSnapshot *snap, int argc, char* argv[], RequestSource source,
+                            FILE *out, FILE *err) {
+    forgetLiveProperties(snap);
+    daemonRequestDepth++;
+    int status = runCommand(snap, argc, argv, out, err);
+    daemonRequestDepth--;
+    recordRequest(source, status);
+    if (daemonRequestDepth == 0 && daemonRebuildPending) {
+        daemonRebuildPending = false;
+        rebuildDaemonSnapshot(snap);
+    }
+    return status;
+}
+
+static void serveDaemonRequest(DeviceSnapshot *snap, int fd) {
+    // A stuck client must not wedge the run loop that also delivers HAL events.
+    struct timeval timeout = { .tv_sec = 1, .tv_usec = 0 };
+    setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &timeout, sizeof(timeout));
+
+    char *request = tracedMalloc(DAEMON_MAX_REQUEST);
+    if (!request) {
+        return;
+    }
+
+    size_t len = 0;
+    while (len < DAEMON_MAX_REQUEST) {
+        ssize_t n = read(fd, request + len, DAEMON_MAX_REQUEST - len);
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n <= 0) {
+            break;
+        }
+        len += (size_t)n;
+    }
+    // A client that gave up waiting has run the command itself, and a busy
+    // reply sends it off to do so.
+    char accepted = daemonRequestDepth > 0 ? DAEMON_BUSY : DAEMON_ACCEPTED;
+    if (!writeAll(fd, &accepted, 1) || accepted == DAEMON_BUSY) {
+        free(request);
+        return;
+    }
+
+    // Split the NUL-separated payload back into an argv array.
+    int argc = 0;
+    for (size_t i = 0; i < len; i++) {
+        if (request[i] == '\0') {
+            argc++;
+        }
+    }
+
+    char *outBuf = NULL, *errBuf = NULL;
+    size_t outLen = 0, errLen = 0;
+    FILE *out = open_memstream(&outBuf, &outLen);
+    FILE *err = open_memstream(&errBuf, &errLen);
+    char **argv = tracedCalloc((size_t)argc + 1, sizeof(char *));
+    int status = 1;
+
+    if (out && err && argv && argc >= 2 && request[len - 1] == '\0') {
+        char *p = request;
+        for (int i = 0; i < argc; i++) {
+            argv[i] = p;
+            p += strlen(p) + 1;
+        }
+        status = runDaemonCommand(snap, argc, argv, REQUEST_SOCKET, out, err);
+    } else if (err) {
+        fprintf(err, "Malformed request\n");
+    }
+
+    if (out) {
+        fclose(out);
+    }
+    if (err) {
+        fclose(err);
+    }
+
+    char header[64];
+    int headerLen = snprintf(header, sizeof(header), "%d %zu %zu\n", status,
+                             outBuf ? outLen : 0, errBuf ? errLen : 0);
+    if (writeAll(fd, header, (size_t)headerLen) && outBuf) {
+        writeAll(fd, outBuf, outLen);
+    }
+    if (errBuf) {
+        writeAll(fd, errBuf, errLen);
+    }
+
+    free(outBuf);
+    free(errBuf);
+    free(argv);
+    free(request);
+}
+
+static void onDaemonAccept(CFSocketRef socket, CFSocketCallBackType type, CFDataRef address,
+                           const void *data, void *info) {
+    (void)socket;
+    (void)address;
+    if (type != kCFSocketAcceptCallBack || !data) {
+        return;
+    }
+    int fd = *(const CFSocketNativeHandle *)data;
+    serveDaemonRequest((DeviceSnapshot *)info, fd);
+    close(fd);
+}
+
+static OSStatus onHardwareChanged(AudioObjectID objectID, UInt32 addressCount,
+                                  const AudioObjectPropertyAddress *addresses, void *clientData) {
+    (void)objectID;
+    DeviceSnapshot *snap = clientData;
+
+    for (UInt32 i = 0; i < addressCount; i++) {
+        if (addresses[i].mSelector == kAudioHardwarePropertyDevices) {
+            if (daemonRequestDepth > 0) {
+                daemonRebuildPending = true;
+            } else {
+                rebuildDaemonSnapshot(snap);
+            }
+        } else {
+            for (int role = 0; role < ROLE_COUNT; role++) {
+                if (addresses[i].mSelector == roleSelectors[role]) {
+                    snap->defaults[role] = getCurrentDefaultDevice((DeviceRole)role);
+                }
+            }
+        }
+    }
+    return noErr;
+}
+
+static void removeDaemonSocket(int sig) {
+    unlink(daemonSocketPathBuf);
+    _exit(sig == SIGTERM || sig == SIGINT ? 0 : 1);
+}
+
+static int bindDaemonSocket(const char *path) {
+    struct sockaddr_un addr;
+    if (!fillSocketAddress(&addr, path)) {
+        fprintf(stderr, "Socket path too long: %s\n", path);
+        return -1;
+    }
+
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) {
+        perror("socket");
+        return -1;
+    }
+
+    // Only the owning user may talk to the daemon.
+    mode_t oldMask = umask(077);
+    int rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    if (rc != 0 && errno == EADDRINUSE) {
+        int probe = connectToDaemon();
+        if (probe >= 0) {
+            close(probe);
+            umask(oldMask);
+            close(fd);
+            fprintf(stderr, "A switch_audio daemon is already listening on %s\n", path);
+            return -1;
+        }
+        // Stale socket left behind by a daemon that did not exit cleanly.
+        unlink(path);
+        rc = bind(fd, (struct sockaddr *)&addr, sizeof(addr));
+    }
+    umask(oldMask);
+
+    if (rc != 0 || listen(fd, 16) != 0) {
+        perror(path);
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+// ---------------------------------------------------------------------------
+// Hotkeys
+//
+// The daemon can register global shortcuts itself, so a key press switches
+// devices without spawning a process: the bound command line runs in-process
+// against the cached snapshot, and "-n" costs the one HAL set call. Bindings
+// come from --hotkey "KEYS = COMMAND" and ~/.config/switch_audio/hotkeys (or
+// SWITCH_AUDIO_HOTKEYS), one per line:
+//
+//     ctrl+opt+n = -n
+//     ctrl+opt+d = -n --set desk
+//     ctrl+opt+h = phones --volume 40
+//
+// Carbon's RegisterEventHotKey needs no accessibility permission. Presses
+// arrive as Carbon events, which only the Carbon event loop dispatches, so a
+// daemon with hotkeys runs RunApplicationEventLoop() instead of CFRunLoopRun();
+// it drives the same run loop, socket and HAL listeners included.
+// ---------------------------------------------------------------------------
+
+#ifndef SWITCH_AUDIO_NO_HOTKEYS
+
+#define MAX_HOTKEYS 32
+#define HOTKEY_MAX_WORDS 16
+#define HOTKEY_SIGNATURE 0x53574148u   // 'SWAH'
+
+typedef struct {
+    const char *name;
+    UInt32 keyCode;
+} HotkeyKey;
+
+static const HotkeyKey hotkeyKeys[] = {
+    { "a", kVK_ANSI_A }, { "b", kVK_ANSI_B }, { "c", kVK_ANSI_C }, { "d", kVK_ANSI_D },
+    { "e", kVK_ANSI_E }, { "f", kVK_ANSI_F }, { "g", kVK_ANSI_G }, { "h", kVK_ANSI_H },
+    { "i", kVK_ANSI_I }, { "j", kVK_ANSI_J }, { "k", kVK_ANSI_K }, { "l", kVK_ANSI_L },
+    { "m", kVK_ANSI_M }, { "n", kVK_ANSI_N }, { "o", kVK_ANSI_O }, { "p", kVK_ANSI_P },
+    { "q", kVK_ANSI_Q }, { "r", kVK_ANSI_R }, { "s", kVK_ANSI_S }, { "t", kVK_ANSI_T },
+    { "u", kVK_ANSI_U }, { "v", kVK_ANSI_V }, { "w", kVK_ANSI_W }, { "x", kVK_ANSI_X },
+    { "y", kVK_ANSI_Y }, { "z", kVK_ANSI_Z },
+    { "0", kVK_ANSI_0 }, { "1", kVK_ANSI_1 }, { "2", kVK_ANSI_2 }, { "3", kVK_ANSI_3 },
+    { "4", kVK_ANSI_4 }, { "5", kVK_ANSI_5 }, { "6", kVK_ANSI_6 }, { "7", kVK_ANSI_7 },
+    { "8", kVK_ANSI_8 }, { "9", kVK_ANSI_9 },
+    { "f1", kVK_F1 }, { "f2", kVK_F2 }, { "f3", kVK_F3 }, { "f4", kVK_F4 }, { "f5", kVK_F5 },
+    { "f6", kVK_F6 }, { "f7", kVK_F7 }, { "f8", kVK_F8 }, { "f9", kVK_F9 }, { "f10", kVK_F10 },
+    { "f11", kVK_F11 }, { "f12", kVK_F12 }, { "f13", kVK_F13 }, { "f14", kVK_F14 },
+    { "f15", kVK_F15 }, { "f16", kVK_F16 }, { "f17", kVK_F17 }, { "f18", kVK_F18 },
+    { "f19", kVK_F19 }, { "f20", kVK_F20 },
+    { "space", kVK_Space }, { "return", kVK_Return }, { "enter", kVK_Return }, { "tab", kVK_Tab },
+    { "escape", kVK_Escape }, { "esc", kVK_Escape }, { "delete", kVK_Delete },
+    { "left", kVK_LeftArrow }, { "right", kVK_RightArrow }, { "up", kVK_UpArrow }, { "down", kVK_DownArrow },
+    { "home", kVK_Home }, { "end", kVK_End }, { "pageup", kVK_PageUp }, { "pagedown", kVK_PageDown },
+    { "minus", kVK_ANSI_Minus }, { "equal", kVK_ANSI_Equal }, { "comma", kVK_ANSI_Comma },
+    { "period", kVK_ANSI_Period }, { "slash", kVK_ANSI_Slash }, { "semicolon", kVK_ANSI_Semicolon },
+    { "quote", kVK_ANSI_Quote }, { "backslash", kVK_ANSI_Backslash }, { "grave", kVK_ANSI_Grave },
+    { "[", kVK_ANSI_LeftBracket }, { "]", kVK_ANSI_RightBracket },
+};
+
+typedef struct {
+    const char *name;
+    UInt32 mask;
+} HotkeyModifier;
+
+static const HotkeyModifier hotkeyModifiers[] = {
+    { "cmd", cmdKey }, { "command", cmdKey },
+    { "ctrl", controlKey }, { "control", controlKey },
+    { "alt", optionKey }, { "opt", optionKey }, { "option", optionKey },
+    { "shift", shiftKey },
+};
+
+typedef struct {
+    char *spec;                 // KEYS as written, for messages
+    char *command;              // split in place into argv
+    char *argv[HOTKEY_MAX_WORDS + 2];
+    int argc;
+    UInt32 keyCode;
+    UInt32 modifiers;
+    EventHotKeyRef ref;         // NULL until registered
+} Hotkey;
+
+static Hotkey hotkeys[MAX_HOTKEYS];
+static int hotkeyCount;
+static ConfigTable hotkeyTable = {
+    .envName = "SWITCH_AUDIO_HOTKEYS",
+    .fileName = "hotkeys",
+    .valueLabel = "command",
+    .quoted = true
+};
+
+// Parses "ctrl+opt+n": any number of modifiers, then exactly one key, joined
+// by '+' and ignoring case and spaces. At least one modifier is required so
+// a binding cannot swallow plain typing.
+static bool parseHotkeySpec(const char *spec, UInt32 *keyCode, UInt32 *modifiers) {
+    *keyCode = 0;
+    *modifiers = 0;
+    bool haveKey = false;
+    const char *p = spec;
+    while (*p) {
+        const char *end = strchr(p, '+');
+        const char *partEnd = end ? end : p + strlen(p);
+        trimSpan(&p, &partEnd);
+        size_t len = (size_t)(partEnd - p);
+        bool matched = false;
+        for (size_t i = 0; !matched && i < sizeof(hotkeyModifiers) / sizeof(hotkeyModifiers[0]); i++) {
+            if (strlen(hotkeyModifiers[i].name) == len && strncasecmp(p, hotkeyModifiers[i].name, len) == 0) {
+                *modifiers |= hotkeyModifiers[i].mask;
+                matched = true;
+            }
+        }
+        for (size_t i = 0; !matched && !haveKey && i < sizeof(hotkeyKeys) / sizeof(hotkeyKeys[0]); i++) {
+            if (strlen(hotkeyKeys[i].name) == len && strncasecmp(p, hotkeyKeys[i].name, len) == 0) {
+                *keyCode = hotkeyKeys[i].keyCode;
+                haveKey = matched = true;
+            }
+        }
+        if (!matched) {
+            return false;
+        }
+        if (!end) {
+            break;
+        }
+        p = end + 1;
+    }
+    return haveKey && *modifiers != 0;
+}
+
+static bool addHotkey(const char *spec, size_t specLen, const char *command, FILE *err) {
+    if (hotkeyCount == MAX_HOTKEYS) {
+        fprintf(err, "Error: at most %d hotkeys can be bound.\n", MAX_HOTKEYS);
+        return false;
+    }
+    Hotkey *hotkey = &hotkeys[hotkeyCount];
+    const char *specEnd = spec + specLen;
+    trimSpan(&spec, &specEnd);
+    hotkey->spec = strndup(spec, (size_t)(specEnd - spec));
+    hotkey->command = strdup(command);
+    if (!hotkey->spec || !hotkey->command) {
+        free(hotkey->spec);
+        free(hotkey->command);
+        return false;
+    }
+    hotkey->argv[0] = "switch_audio";
+    int words = splitCommandLine(hotkey->command, hotkey->argv + 1, HOTKEY_MAX_WORDS);
+    if (words > 0) {
+        words = joinFallbackWords(hotkey->argv + 1, words);
+    }
+    if (words <= 0) {
+        fprintf(err, "Error: hotkey %s needs a command (at most %d words).\n", hotkey->spec, HOTKEY_MAX_WORDS);
+        free(hotkey->spec);
+        free(hotkey->command);
+        return false;
+    }
+    hotkey->argc = words + 1;
+    hotkey->argv[hotkey->argc] = NULL;
+    hotkeyCount++;
+    return true;
+}
+
+// --hotkey "KEYS = COMMAND"
+static bool parseHotkeyOption(const char *arg, FILE *err) {
+    const char *eq = strchr(arg, '=');
+    if (!eq) {
+        fprintf(err, "Error: --hotkey needs \"KEYS = COMMAND\", e.g. \"ctrl+opt+n = -n\".\n");
+        return false;
+    }
+    return addHotkey(arg, (size_t)(eq - arg), eq + 1, err);
+}
+
+static bool loadHotkeyFile(FILE *err) {
+    refreshConfigTable(&hotkeyTable);
+    for (UInt32 i = 0; i < hotkeyTable.count; i++) {
+        const ConfigEntry *entry = &hotkeyTable.entries[i];
+        if (!addHotkey(entry->matchName, strlen(entry->matchName), entry->value, err)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static OSStatus onHotkeyPressed(EventHandlerCallRef next, EventRef event, void *userData) {
+    (void)next;
+    EventHotKeyID hotKeyID;
+    if (GetEventParameter(event, kEventParamDirectObject, typeEventHotKeyID, NULL, sizeof(hotKeyID), NULL,
+                          &hotKeyID) != noErr || hotKeyID.signature != HOTKEY_SIGNATURE
+        || hotKeyID.id >= (UInt32)hotkeyCount) {
+        return eventNotHandledErr;
+    }
+    // A --wait request pumps the run loop; a press landing inside it would
+    // change the snapshot under that request.
+    Hotkey *hotkey = &hotkeys[hotKeyID.id];
+    if (daemonRequestDepth > 0) {
+        fprintf(stderr, "Ignoring hotkey %s while a request is running\n", hotkey->spec);
+        return noErr;
+    }
+    os_signpost_id_t signpost = traceSignpostID();
+    TRACE_BEGIN(signpost, "hotkey", "%s", hotkey->spec);
+    int status = runDaemonCommand(userData, hotkey->argc, hotkey->argv, REQUEST_HOTKEY, stdout, stderr);
+    TRACE_END(signpost, "hotkey", "status %d", status);
+    fflush(stdout);
+    return noErr;
+}
+
+// Registers every bound hotkey and counts them in *registered. One already
+// taken by another application is reported and skipped rather than stopping
+// the daemon.
+static bool registerHotkeys(DeviceSnapshot *snap, int *registered) {
+    *registered = 0;
+    if (hotkeyCount == 0) {
+        return true;
+    }
+    EventTypeSpec pressed = { kEventClassKeyboard, kEventHotKeyPressed };
+    if (InstallEventHandler(GetApplicationEventTarget(), NewEventHandlerUPP(onHotkeyPressed), 1, &pressed,
+                            snap, NULL) != noErr) {
+        fprintf(stderr, "Failed to install the hotkey handler\n");
+        return false;
+    }
+    for (int i = 0; i < hotkeyCount; i++) {
+        Hotkey *hotkey = &hotkeys[i];
+        if (!parseHotkeySpec(hotkey->spec, &hotkey->keyCode, &hotkey->modifiers)) {
+            fprintf(stderr, "Unknown hotkey \"%s\"; use modifiers cmd, ctrl, opt, shift and one key, e.g. ctrl+opt+n\n",
+                    hotkey->spec);
+            continue;
+        }
+        // --hotkey comes before the file, so the command line wins.
+        const Hotkey *earlier = NULL;
+        for (int j = 0; j < i && !earlier; j++) {
+            if (hotkeys[j].ref && hotkeys[j].keyCode == hotkey->keyCode && hotkeys[j].modifiers == hotkey->modifiers) {
+                earlier = &hotkeys[j];
+            }
+        }
+        if (earlier) {
+            fprintf(stderr, "Hotkey %s is already bound as %s; ignoring the later binding\n",
+                    hotkey->spec, earlier->spec);
+            continue;
+        }
+        EventHotKeyID hotKeyID = { HOTKEY_SIGNATURE, (UInt32)i };
+        OSStatus status = RegisterEventHotKey(hotkey->keyCode, hotkey->modifiers, hotKeyID,
+                                              GetApplicationEventTarget(), 0, &hotkey->ref);
+        if (status != noErr) {
+            hotkey->ref = NULL;
+            fprintf(stderr, "Cannot register hotkey %s (%d); it may be taken by another application\n",
+                    hotkey->spec, (int)status);
+            continue;
+        }
+        (*registered)++;
+        fprintf(stderr, "Hotkey %s runs:", hotkey->spec);
+        for (int word = 1; word < hotkey->argc; word++) {
+            fprintf(stderr, " %s", hotkey->argv[word]);
+        }
+        fprintf(stderr, "\n");
+    }
+    return true;
+}
+
+#endif
+
+static int runDaemon(int argc, char* argv[]) {
+    const char *preferSpec = NULL;
+    for (int i = 2; i < argc; i++) {
+        if (strcmp(argv[i], "--prefer") == 0 && i + 1 < argc) {
+            preferSpec = argv[++i];
+        } else if (strcmp(argv[i], "--hotkey") == 0 && i + 1 < argc) {
+#ifndef SWITCH_AUDIO_NO_HOTKEYS
+            if (!parseHotkeyOption(argv[++i], stderr)) {
+                return 1;
+            }
+#else
+            fprintf(stderr, "Error: this build has no hotkey support (built with SWITCH_AUDIO_NO_HOTKEYS).\n");
+            return 1;
+#endif
+        } else {
+            fprintf(stderr, "Error: --daemon only accepts --prefer LIST and --hotkey \"KEYS = COMMAND\".\n");
+            return 1;
+        }
+    }
+    if (!loadPreferences(preferSpec, stderr)) {
+        return 1;
+    }
+#ifndef SWITCH_AUDIO_NO_HOTKEYS
+    if (!loadHotkeyFile(stderr)) {
+        return 1;
+    }
+#endif
+
+    if (!getDaemonSocketPath(daemonSocketPathBuf, sizeof(daemonSocketPathBuf))) {
+        fprintf(stderr, "Socket path too long\n");
+        return 1;
+    }
+
+    int listenFd = bindDaemonSocket(daemonSocketPathBuf);
+    if (listenFd < 0) {
+        return 1;
+    }
+
+    signal(SIGPIPE, SIG_IGN);
+    signal(SIGINT, removeDaemonSocket);
+    signal(SIGTERM, removeDaemonSocket);
+    signal(SIGHUP, removeDaemonSocket);
+
+    enableMetrics();
+    static DeviceSnapshot snap;
+    if (buildDeviceSnapshot(&snap) != noErr) {
+        fprintf(stderr, "Error getting device list\n");
+        removeDaemonSocket(0);
+    }
+    trackDeviceMetrics(&snap, false);
+    saveCachedSnapshot(&snap);
+    applyPreferences(&snap);
+
+    // Deliver HAL notifications on this run loop so the snapshot is only ever
+    // touched from one thread.
+    CFRunLoopRef runLoop = CFRunLoopGetCurrent();
+    setHALNotificationRunLoop(runLoop);
+
+    AudioObjectPropertyAddress watched[] = {
+        { kAudioHardwarePropertyDevices, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioHardwarePropertyDefaultOutputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioHardwarePropertyDefaultInputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+        { kAudioHardwarePropertyDefaultSystemOutputDevice, kAudioObjectPropertyScopeGlobal, kAudioObjectPropertyElementMain },
+    };
+    for (size_t i = 0; i < sizeof(watched) / sizeof(watched[0]); i++) {
+        if (AudioObjectAddPropertyListener(kAudioObjectSystemObject, &watched[i],
+                                           onHardwareChanged, &snap) != noErr) {
+            fprintf(stderr, "Failed to register HAL property listener\n");
+            removeDaemonSocket(0);
+        }
+    }
+
+    CFSocketContext context = { .version = 0, .info = &snap };
+    CFSocketRef listenSocket = CFSocketCreateWithNative(kCFAllocatorDefault, listenFd,
+                                                        kCFSocketAcceptCallBack, onDaemonAccept, &context);
+    CFRunLoopSourceRef source = CFSocketCreateRunLoopSource(kCFAllocatorDefault, listenSocket, 0);
+    CFRunLoopAddSource(runLoop, source, kCFRunLoopDefaultMode);
+
+    int registeredHotkeys = 0;
+#ifndef SWITCH_AUDIO_NO_HOTKEYS
+    if (!registerHotkeys(&snap, &registeredHotkeys)) {
+        removeDaemonSocket(0);
+    }
+#endif
+
+    fprintf(stderr, "switch_audio daemon listening on %s\n", daemonSocketPathBuf);
+    if (registeredHotkeys > 0) {
+#ifndef SWITCH_AUDIO_NO_HOTKEYS
+        RunApplicationEventLoop();
+#endif
+    } else {
+        CFRunLoopRun();
+    }
+
+    removeDaemonSocket(0);
+    return 0;
+}
+
+// ---------------------------------------------------------------------------
+// Benchmark harness
+//
+// --bench N repeats every command path N times and reports min/median/p99
+// wall time per phase, measured with mach_absolute_time(). Nothing here
+// changes the audible state: "set default" re-selects the current device and
+// "next" only resolves the target without switching. The last two phases time
+// whole child processes for --version and --complete, i.e. startup cost.
+// ---------------------------------------------------------------------------
+
+typedef struct {
+    const char *label;
+    UInt64 *samples;
+    int count;
+} BenchPhase;
+
+enum {
+    BENCH_ENUMERATE,
+    BENCH_PROBE,
+    BENCH_NAMES,
+    BENCH_UIDS,
+    BENCH_SNAPSHOT_LIVE,
+    BENCH_SNAPSHOT_CACHED,
+    BENCH_LIST,
+    BENCH_FIND,
+    BENCH_NEXT,
+    BENCH_SET_DEFAULT,
+    BENCH_START_VERSION,
+    BENCH_START_COMPLETE,
+    BENCH_PHASE_COUNT
+};
+
+static const char *const benchLabels[BENCH_PHASE_COUNT] = {
+    [BENCH_ENUMERATE] = "enumerate devices",
+    [BENCH_PROBE] = "capability probe (all)",
+    [BENCH_NAMES] = "name fetch (outputs)",
+    [BENCH_UIDS] = "UID fetch (outputs)",
+    [BENCH_SNAPSHOT_LIVE] = "snapshot, live",
+    [BENCH_SNAPSHOT_CACHED] = "snapshot, cached",
+    [BENCH_LIST] = "-l path",
+    [BENCH_FIND] = "find by name path",
+    [BENCH_NEXT] = "-n path (resolve only)",
+    [BENCH_SET_DEFAULT] = "set default (same)",
+    [BENCH_START_VERSION] = "process start, --version",
+    [BENCH_START_COMPLETE] = "process start, --complete",
+};
+
+static void benchRecord(BenchPhase *phase, UInt64 start) {
+    phase->samples[phase->count++] = mach_absolute_time() - start;
+}
+
+static int compareTicks(const void *a, const void *b) {
+    UInt64 x = *(const UInt64 *)a, y = *(const UInt64 *)b;
+    return (x > y) - (x < y);
+}
+
+static void printBenchPhase(BenchPhase *phase, FILE *out) {
+    if (phase->count == 0) {
+        fprintf(out, "  %-26s %10s %10s %10s\n", phase->label, "n/a", "n/a", "n/a");
+        return;
+    }
+    qsort(phase->samples, (size_t)phase->count, sizeof(UInt64), compareTicks);
+    int p99 = (phase->count * 99 + 99) / 100 - 1;
+    fprintf(out, "  %-26s %10.1f %10.1f %10.1f\n", phase->label,
+            ticksToMicros(phase->samples[0]),
+            ticksToMicros(phase->samples[phase->count / 2]),
+            ticksToMicros(phase->samples[p99]));
+}
+
+// Startup phases: spawn this binary and wait for it, so the numbers include
+// exec, dyld and framework loading that the in-process phases cannot see.
+static void benchSpawn(BenchPhase *phase, const char *progPath, const char *arg, FILE *sink) {
+    posix_spawn_file_actions_t actions;
+    if (posix_spawn_file_actions_init(&actions) != 0) {
+        return;
+    }
+    posix_spawn_file_actions_adddup2(&actions, fileno(sink), STDOUT_FILENO);
+    char *childArgv[] = { (char *)progPath, (char *)arg, NULL };
+    UInt64 start = mach_absolute_time();
+    pid_t pid;
+    int status;
+    if (posix_spawnp(&pid, progPath, &actions, NULL, childArgv, environ) == 0
+        && waitpid(pid, &status, 0) == pid && WIFEXITED(status) && WEXITSTATUS(status) == 0) {
+        benchRecord(phase, start);
+    }
+    posix_spawn_file_actions_destroy(&actions);
+}
+
+static void benchIteration(BenchPhase *phases, const char *progPath, FILE *sink) {
+    DeviceList list;
+    UInt64 start = mach_absolute_time();
+    if (getAudioDeviceList(&list) != noErr) {
+        return;
+    }
+    benchRecord(&phases[BENCH_ENUMERATE], start);
+    const AudioDeviceID *devices = list.ids;
+    UInt32 deviceCount = list.count;
+
+    bool inlineHasOutput[DEVICE_LIST_INLINE];
+    bool *hasOutput = deviceCount <= DEVICE_LIST_INLINE ? inlineHasOutput : tracedCalloc(deviceCount, sizeof(bool));
+    if (!hasOutput) {
+        freeDeviceList(&list);
+        return;
+    }
+    start = mach_absolute_time();
+    for (UInt32 i = 0; i < deviceCount; i++) {
+        UInt32 channels;
+        hasOutput[i] = deviceSupportsScope(devices[i], kAudioDevicePropertyScopeOutput, &channels);
+    }
+    benchRecord(&phases[BENCH_PROBE], start);
+
+    start = mach_absolute_time();
+    for (UInt32 i = 0; i < deviceCount; i++) {
+        if (hasOutput[i]) {
+            free(getDeviceName(devices[i]));
+        }
+    }
+    benchRecord(&phases[BENCH_NAMES], start);
+
+    start = mach_absolute_time();
+    for (UInt32 i = 0; i < deviceCount; i++) {
+        if (hasOutput[i]) {
+            free(getDeviceUID(devices[i]));
+        }
+    }
+    benchRecord(&phases[BENCH_UIDS], start);
+    if (hasOutput != inlineHasOutput) {
+        free(hasOutput);
+    }
+    freeDeviceList(&list);
+
+    DeviceSnapshot snap;
+    start = mach_absolute_time();
+    if (buildDeviceSnapshot(&snap) == noErr) {
+        benchRecord(&phases[BENCH_SNAPSHOT_LIVE], start);
+        freeDeviceSnapshot(&snap);
+    }
+
+    start = mach_absolute_time();
+    if (getAudioDeviceList(&list) == noErr) {
+        bool hit = loadCachedSnapshot(&snap, list.ids, list.count);
+        freeDeviceList(&list);
+        if (hit) {
+            benchRecord(&phases[BENCH_SNAPSHOT_CACHED], start);
+            freeDeviceSnapshot(&snap);
+        }
+    }
+
+    start = mach_absolute_time();
+    if (acquireDeviceSnapshot(&snap, NULL) == noErr) {
+        listAudioDevices(&snap, ROLE_OUTPUT, FORMAT_TEXT, sink);
+        fflush(sink);
+        benchRecord(&phases[BENCH_LIST], start);
+        freeDeviceSnapshot(&snap);
+    }
+
+    start = mach_absolute_time();
+    if (acquireDeviceSnapshot(&snap, NULL) == noErr) {
+        const DeviceInfo *current = NULL;
+        for (UInt32 i = 0; i < snap.count; i++) {
+            if (snap.devices[i].id == snap.defaults[ROLE_OUTPUT]) {
+                current = &snap.devices[i];
+            }
+        }
+        if (current && current->name) {
+            const DeviceInfo *found;
+            findDeviceByName(&snap, ROLE_OUTPUT, current->name, &found);
+            benchRecord(&phases[BENCH_FIND], start);
+        }
+        freeDeviceSnapshot(&snap);
+    }
+
+    start = mach_absolute_time();
+    if (acquireDeviceSnapshot(&snap, NULL) == noErr) {
+        const DeviceInfo *current;
+        findNextDevice(&snap, ROLE_OUTPUT, &current);
+        benchRecord(&phases[BENCH_NEXT], start);
+        freeDeviceSnapshot(&snap);
+    }
+
+    AudioDeviceID currentDefault = getCurrentDefaultDevice(ROLE_OUTPUT);
+    if (currentDefault != kAudioObjectUnknown) {
+        start = mach_absolute_time();
+        if (setDefaultDevice(ROLE_OUTPUT, currentDefault) == noErr) {
+            benchRecord(&phases[BENCH_SET_DEFAULT], start);
+        }
+    }
+
+    benchSpawn(&phases[BENCH_START_VERSION], progPath, "--version", sink);
+    benchSpawn(&phases[BENCH_START_COMPLETE], progPath, "--complete", sink);
+}
+
+static int runBenchmark(const char *progPath, const char *iterationsArg) {
+    char *end;
+    long iterations = strtol(iterationsArg, &end, 10);
+    if (*end != '\0' || iterations < 1 || iterations > 1000000) {
+        fprintf(stderr, "Error: --bench needs an iteration count between 1 and 1000000.\n");
+        return 1;
+    }
+
+    FILE *sink = fopen("/dev/null", "w");
+    BenchPhase phases[BENCH_PHASE_COUNT];
+    UInt64 *storage = tracedCalloc((size_t)iterations * BENCH_PHASE_COUNT, sizeof(UInt64));
+    if (!sink || !storage) {
+        fprintf(stderr, "Error: cannot set up benchmark\n");
+        if (sink) {
+            fclose(sink);
+        }
+        free(storage);
+        return 1;
+    }
+    for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+        phases[i] = (BenchPhase){ benchLabels[i], storage + (size_t)i * iterations, 0 };
+    }
+
+    // Make sure the cached phases measure a hit rather than the first miss.
+    DeviceSnapshot warm;
+    if (buildDeviceSnapshot(&warm) != noErr) {
+        fprintf(stderr, "Error getting device list\n");
+        fclose(sink);
+        free(storage);
+        return 1;
+    }
+    UInt32 deviceCount = warm.count;
+    saveCachedSnapshot(&warm);
+    freeDeviceSnapshot(&warm);
+
+    for (long i = 0; i < iterations; i++) {
+        benchIteration(phases, progPath, sink);
+    }
+
+    printf("%ld iterations, %u devices (times in microseconds)\n", iterations, (unsigned)deviceCount);
+    printf("  %-26s %10s %10s %10s\n", "phase", "min", "median", "p99");
+    for (int i = 0; i < BENCH_PHASE_COUNT; i++) {
+        printBenchPhase(&phases[i], stdout);
+    }
+
+    fclose(sink);
+    free(storage);
+    return 0;
+}
+
+int main(int argc, char* argv[]) {
+    // --trace may appear anywhere and applies to the whole invocation.
+    const char *traceEnv = getenv("SWITCH_AUDIO_TRACE");
+    if (traceEnv && *traceEnv && strcmp(traceEnv, "0") != 0) {
+        enableTrace();
+    }
+    int kept = 1;
+    for (int i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "--trace") == 0) {
+            enableTrace();
+        } else {
+            argv[kept++] = argv[i];
+        }
+    }
+    argc = kept;
+    argv[argc] = NULL;
+
+    if (argc < 2) {
+        printUsage(argv[0], stdout);
+        return 1;
+    }
+
+    // Handle help option
+    if (strcmp(argv[1], "-h") == 0 || strcmp(argv[1], "--help") == 0) {
+        printUsage(argv[0], stdout);
+        return 0;
+    }
+
+    // Neither of these touches the HAL, so they stay as fast as process
+    // startup allows.
+    if (strcmp(argv[1], "--version") == 0) {
+        printf("switch_audio %s\n", SWITCH_AUDIO_VERSION);
+        return 0;
+    }
+
+    if (strcmp(argv[1], "--complete") == 0) {
+        return runComplete(argc, argv);
+    }
+
+    if (strcmp(argv[1], "--daemon") == 0) {
+        return runDaemon(argc, argv);
+    }
+
+    if (strcmp(argv[1], "--watch") == 0) {
+        return runWatch(argc, argv);
+    }
+
+    if (strcmp(argv[1], "--bench") == 0) {
+        if (argc != 3) {
+            fprintf(stderr, "Error: --bench takes exactly one iteration count.\n");
+            return 1;
+        }
+        return runBenchmark(argv[0], argv[2]);
+    }
+
+    // Batches read local input, and traces are about this process's HAL
+    // traffic, so neither is forwarded to a daemon; nor are lines that wait.
+    bool batch = strcmp(argv[1], "--batch") == 0;
+    if (batch && argc > 3) {
+        fprintf(stderr, "Error: --batch takes at most one file.\n");
+        return 1;
+    }
+
+    int status;
+    const char *noDaemon = getenv("SWITCH_AUDIO_NO_DAEMON");
+    if (!batch && !traceEnabled && !commandWaits(argc, argv) && (!noDaemon || !*noDaemon)
+        && forwardToDaemon(argc, argv, &status)) {
+        return status;
+    }
+
+    if (!batch) {
+        return runCommand(NULL, argc, argv, stdout, stderr);
+    }
+
+    DeviceSnapshot snap;
+    if (acquireDeviceSnapshot(&snap, NULL) != noErr) {
+        fprintf(stderr, "Error getting device list\n");
+        return 1;
+    }
+    status = runBatch(&snap, argv[0], argc > 2 ? argv[2] : NULL, stdout, stderr);
+    freeDeviceSnapshot(&snap);
+    return status;
 }